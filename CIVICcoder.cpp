@@ -44,9 +44,35 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
 #include <math.h>
 
+#include <thread>				// for parallel decoding of large files (-file=...)
+#include <mutex>
+#include <condition_variable>
+#include <atomic>				// for self test (-test=...)
+#include <chrono>				// for timing loading of corpus (-corpus=...)
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>			// for CreateFileMapping / MapViewOfFile
+#include <io.h>					// for _read
+#else
+#include <sys/mman.h>			// for mmap
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>				// for -watch=...
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>		// for -watch=...
+#include <fnmatch.h>
+#endif
+
 #define INLINE __inline
 
 //////////////////////////////////////////////////////////////////////////////////////////////
@@ -70,7 +96,7 @@ enum measurement_type {
 // Subelement IDs for Location Civic report
 // NOTE: code below deals with LOCATION_CIVIC (ID 0) and with MAP_IMAGE_CIVIC (ID 5), 
 // (because that is what Android API makes provision for currently)
-// TODO: deal with LOCATION_SHAPE_CIVIC (ID 4) ? when Android supports it ?
+// and with LOCATION_REFERENCE_CIVIC (ID 3) and LOCATION_SHAPE_CIVIC (ID 4) (e.g. room outlines on a floor map)
 // TODO: deal with COLOCATED_BSSID (ID 7) ? assuming it does exist in CIVIC element (*) ?
 
 enum civic_subelement_code {
@@ -107,10 +133,32 @@ int checkflag = 0;		// -c (check result after decoding or encoding)
 
 int sampleflag = 0;		// run an example of decoding and encoding an CIVIC string
 
+int streamflag = 0;		// -stream (decode CIVIC strings from stdin as they arrive)
+int rawflag = 0;		// -raw (input for -stream is raw octets rather than hex)
+int chunksize = 4096;	// -chunk=... (bytes read from stdin at a time for -stream)
+
+int civicbudget = 0;	// -budget=... (most octets accepted in one CIVIC string when decoding, 0 => no limit)
+
+long long ntests = 0;	// -test=... (number of random records for round trip self test)
+
 ///////////////////////////////////////////////////////////////////////////////
 
 char const * civicstring = NULL;	//  civic string to decode if given on command line using -civic=...
 
+char const * civicfile = NULL;		// file of civic strings (one per line) to decode given using -file=...
+
+int nthreads = 0;					// threads used to decode -file=... (0 => one per core) given using -threads=...
+
+char const * exportfile = NULL;		// columnar binary file to write decoded -file=... into given using -export=...
+
+char const * corpusfile = NULL;		// columnar binary file to load given using -corpus=...
+
+int corpuscolumn = -1;				// CA type to list from -corpus=... given using -column=...
+
+char const * watchdir = NULL;		// directory of hostapd.conf files to keep checking given using -watch=...
+
+char const * watchpattern = "*.conf";	// which files in -watch=... directory to check, given using -match=...
+
 char const * mapimagestring = NULL;	// map URL given on command line using -mapimage=https://... IETF RFC 3986
 
 int mapmemetype = 0;				// map meme --- default URL_DEFINED or given on command line using -mapmeme=...
@@ -119,6 +167,12 @@ char const ** CA = NULL;			// array of strings for civic location address values
 
 char const *country_code="US";		// (default) civic location country - given on command line using -country=...
 
+char const * locationreference = NULL;	// reference point for location shapes given using -reference=...
+
+struct location_shape *locationshapes = NULL;	// shapes given on command line using -shape=...
+
+int nlocationshapes = 0;
+
 // See: ISO 3166-1 alpha-2 see https://en.wikipedia.org/wiki/ISO_3166-1_alpha-2
 
 /////////////////////////////////////////////////////////////////////////////////////////////
@@ -171,6 +225,65 @@ int puthexstring(char *str, int nbyt, int nlen, const char *line) {
 	return nbyt;
 }
 
+int INLINE ishexchar(int c) {
+	return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f');
+}
+
+// Growing text buffer, so that output of decoding can be collected (in parallel) and printed later
+
+typedef struct textbuf {
+	char *text;
+	int nlen;	// bytes used (not counting null terminator)
+	int alen;	// bytes allocated
+} textbuf;
+
+// Print to text buffer - or directly to stdout if tb is NULL
+
+void outprintf(textbuf *tb, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	if (tb == NULL) {
+		vprintf(format, args);
+		va_end(args);
+		return;
+	}
+	int nlen = vsnprintf(tb->text + tb->nlen, tb->alen - tb->nlen, format, args);
+	va_end(args);
+	if (nlen < 0) return;
+	if (tb->nlen + nlen >= tb->alen) {	// not enough space, extend allocation and try again
+		int alen = tb->alen * 2;
+		if (alen < tb->nlen + nlen + 1) alen = tb->nlen + nlen + 1;
+		if (alen < 256) alen = 256;
+		tb->text = (char *) realloc(tb->text, alen);
+		if (tb->text == NULL) exit(1);
+		tb->alen = alen;
+		va_start(args, format);
+		vsnprintf(tb->text + tb->nlen, tb->alen - tb->nlen, format, args);
+		va_end(args);
+	}
+	tb->nlen += nlen;
+}
+
+// Append binary data to text buffer (used for building columns of corpus file)
+
+void appendbytes(textbuf *tb, const void *data, int nlen) {
+	if (nlen > tb->alen - tb->nlen) {
+		if (nlen > 0x7FFFFFFF - tb->nlen) {	// would overflow int
+			printf("ERROR: buffer can't grow beyond %d bytes\n", tb->alen);
+			exit(1);
+		}
+		long long alen = (long long) tb->alen * 2;
+		if (alen > 0x7FFFFFFF) alen = 0x7FFFFFFF;
+		if (alen < tb->nlen + nlen) alen = tb->nlen + nlen;
+		if (alen < 256) alen = 256;
+		tb->text = (char *) realloc(tb->text, (size_t) alen);
+		if (tb->text == NULL) exit(1);
+		tb->alen = (int) alen;
+	}
+	memcpy(tb->text + tb->nlen, data, nlen);
+	tb->nlen += nlen;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////
 
 // TODO: use the following to support UTF8 in strings (particularly for CA values)
@@ -178,7 +291,9 @@ int puthexstring(char *str, int nbyt, int nlen, const char *line) {
 
 #define BYTE unsigned char
 
-BYTE *utf8_from_unicode(int num) {	// UTF8 <= Unicode
+// UTF8 <= Unicode, into str (room for 5 bytes). Returns number of bytes (not counting terminator), 0 if out of range
+
+int utf8_encode(int num, BYTE *str) {
 	int nlen;
 	if (! (num & ~0x7F)) nlen = 1;			// num <128
 	else if (! (num & ~0x7FF)) nlen = 2;	// num < 2048
@@ -186,9 +301,8 @@ BYTE *utf8_from_unicode(int num) {	// UTF8 <= Unicode
 	else if (! (num & ~0x1FFFFF)) nlen = 4;	// num < 2097152
 	else {
 		printf("ERROR: out of range %d > %d\n", num, 0x1FFFFF);	// 2097151
-		return NULL;
+		return 0;
 	}
-	BYTE *str = (BYTE *) malloc((nlen+1) * sizeof(BYTE));
 	if (! (num & ~0x7F)) {		// num < 0x80
 		str[0] = (BYTE) num;
 	}
@@ -208,6 +322,16 @@ BYTE *utf8_from_unicode(int num) {	// UTF8 <= Unicode
 		str[3] = (BYTE)  ((num & 0x3F) | 0x80);			// 128
 	}
 	str[nlen] = '\0';	// zero terminate
+	return nlen;
+}
+
+BYTE *utf8_from_unicode(int num) {	// UTF8 <= Unicode
+	BYTE buf[5];
+	int nlen = utf8_encode(num, buf);
+	if (nlen == 0) return NULL;
+	BYTE *str = (BYTE *) malloc((nlen+1) * sizeof(BYTE));
+	if (str == NULL) exit(1);
+	memcpy(str, buf, nlen+1);
 	return str;
 }
 
@@ -227,17 +351,22 @@ int unicode_from_utf8(const BYTE *str) {	// UNICODE <= UTF8
 	return -1;
 }
 
-void test_utf_unicode (int umax) {
-	for (int k=0; k < umax; k++) {
-		BYTE *str = utf8_from_unicode(k);
+// Returns number of code points (from umin up to umax) that don't survive the round trip
+
+int test_utf_unicode (int umin, int umax) {
+	int nerr = 0;
+	BYTE str[5];
+	for (int k=umin; k < umax; k++) {
+		utf8_encode(k, str);
 		int n = unicode_from_utf8(str);
 		if (n != k) {
 			printf("ERROR: k %d n %d %s\n", k, n, str);
 			fflush(stdout);
+			nerr++;
 		}
-		else if (traceflag) printf("k %d\tn %d\t%s\t%d\n", k, n, str, strlen((char *)str));
-		free(str);
+		else if (traceflag) printf("k %d\tn %d\t%s\t%d\n", k, n, str, (int) strlen((char *)str));
 	}
+	return nerr;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////
@@ -470,6 +599,223 @@ const char *map_meme_type_string (int k) {
 
 //////////////////////////////////////////////////////////////////////////////////
 
+// Location Shape subelement: Location Shape ID (1 octet) followed by shape value.
+// Coordinates, radius and axes are 4 octet IEEE 754 single precision floating point numbers,
+// angle is a 2 octet integer (degrees) - all in little-endian octet order (unlike the rest of the CIVIC string).
+// Polygon: number of points (1 octet) followed by that many 2D points.
+// NOTE: code below deals with 2D/3D points, circles, spheres, polygons and ellipses (not prisms, ellipsoids, arcbands)
+
+enum location_shape_type {
+	POINT_2D_SHAPE=1, POINT_3D_SHAPE=2, CIRCLE_SHAPE=3, SPHERE_SHAPE=4, POLYGON_SHAPE=5,
+	PRISM_SHAPE=6, ELLIPSE_SHAPE=7, ELLIPSOID_SHAPE=8, ARCBAND_SHAPE=9
+};
+
+#define MAX_POLYGON_POINTS 31	// (255 - 2) / 8 points fit in one subelement
+
+typedef struct location_shape {
+	int type;					// location_shape_type
+	int npoints;				// number of (x, y) pairs in xy (polygon vertices, otherwise 1 - center or point)
+	const float *xy;			// x, y coordinates (points to caller's array - so vertices are never copied)
+	float z;					// 3D point, sphere
+	float radius;				// circle, sphere
+	float semimajor, semiminor;	// ellipse
+	int angle;					// ellipse orientation (degrees)
+} location_shape;
+
+const char *shape_type_string(int type) {
+	switch (type) {
+		case POINT_2D_SHAPE: return "2D Point";
+		case POINT_3D_SHAPE: return "3D Point";
+		case CIRCLE_SHAPE: return "Circle";
+		case SPHERE_SHAPE: return "Sphere";
+		case POLYGON_SHAPE: return "Polygon";
+		case PRISM_SHAPE: return "Prism";
+		case ELLIPSE_SHAPE: return "Ellipse";
+		case ELLIPSOID_SHAPE: return "Ellipsoid";
+		case ARCBAND_SHAPE: return "Arcband";
+		default: return NULL;
+	}
+}
+
+int encode_shape_type_string (const char *str, int nlen) {
+	for (int type = POINT_2D_SHAPE; type <= ARCBAND_SHAPE; type++) {
+		const char *name = shape_type_string(type);
+		if ((int) strlen(name) == nlen && _strnicmp(str, name, nlen) == 0) return type;
+	}
+	if (nlen == 5 && _strnicmp(str, "point", nlen) == 0) return POINT_2D_SHAPE;	// alias
+	if (nlen == 7 && _strnicmp(str, "point3d", nlen) == 0) return POINT_3D_SHAPE;	// alias
+	return -1;
+}
+
+float INLINE getfloat(const BYTE *buf) {	// little-endian
+	uint32_t u = (uint32_t) buf[0] | (uint32_t) buf[1] << 8 | (uint32_t) buf[2] << 16 | (uint32_t) buf[3] << 24;
+	float f;
+	memcpy(&f, &u, sizeof(f));
+	return f;
+}
+
+// Number of octets in value of shape of given type (after Location Shape ID) - or -1 if not supported
+
+int shapeValueLength (int type, int npoints) {
+	switch (type) {
+		case POINT_2D_SHAPE: return 8;
+		case POINT_3D_SHAPE: return 12;
+		case CIRCLE_SHAPE: return 8 + 4;
+		case SPHERE_SHAPE: return 12 + 4;
+		case POLYGON_SHAPE: return 1 + 8 * npoints;
+		case ELLIPSE_SHAPE: return 8 + 2 + 4 + 4;
+		default: return -1;
+	}
+}
+
+// Decode body of Location Shape subelement (nlen octets) into shape, with coordinates going into xy
+// (room for 2 * MAX_POLYGON_POINTS floats). Single pass, no allocation. Returns number of errors.
+
+int decodeLocationShape (const BYTE *body, int nlen, location_shape *shape, float *xy, textbuf *tb) {
+	memset(shape, 0, sizeof(location_shape));
+	shape->xy = xy;
+	if (nlen < 1) {
+		outprintf(tb, "ERROR: no room for location shape ID in subelement of %d bytes\n", nlen);
+		return 1;
+	}
+	shape->type = body[0];
+	shape->npoints = 1;
+	if (shape->type == POLYGON_SHAPE) shape->npoints = (nlen >= 2) ? body[1] : 0;
+	int vlen = shapeValueLength(shape->type, shape->npoints);
+	if (vlen < 0) {
+		const char *name = shape_type_string(shape->type);
+		outprintf(tb, "ERROR: location shape %d (%s) not supported\n", shape->type, (name != NULL) ? name : "unknown");
+		return 1;
+	}
+	if (vlen != nlen - 1) {
+		outprintf(tb, "ERROR: location shape %s needs %d bytes, not %d\n", shape_type_string(shape->type), vlen, nlen - 1);
+		return 1;
+	}
+	if (shape->type == POLYGON_SHAPE && shape->npoints < 3) {
+		outprintf(tb, "ERROR: polygon with %d points\n", shape->npoints);
+		return 1;
+	}
+	const BYTE *p = body + 1;
+	if (shape->type == POLYGON_SHAPE) p++;	// number of points
+	for (int k = 0; k < 2 * shape->npoints; k++, p += 4)
+		xy[k] = getfloat(p);
+	switch (shape->type) {
+		case POINT_3D_SHAPE:
+			shape->z = getfloat(p);
+			break;
+		case CIRCLE_SHAPE:
+			shape->radius = getfloat(p);
+			break;
+		case SPHERE_SHAPE:
+			shape->z = getfloat(p);
+			shape->radius = getfloat(p + 4);
+			break;
+		case ELLIPSE_SHAPE:
+			shape->angle = p[0] | p[1] << 8;
+			shape->semimajor = getfloat(p + 2);
+			shape->semiminor = getfloat(p + 6);
+			break;
+		default:
+			break;
+	}
+	return 0;
+}
+
+void showLocationShape (const location_shape *shape, textbuf *tb) {
+	outprintf(tb, "Location Shape: %s", shape_type_string(shape->type));
+	if (shape->type == POLYGON_SHAPE) outprintf(tb, " (%d points)", shape->npoints);
+	for (int k = 0; k < shape->npoints; k++)
+		outprintf(tb, " %g,%g", shape->xy[2*k], shape->xy[2*k+1]);
+	if (shape->type == POINT_3D_SHAPE || shape->type == SPHERE_SHAPE) outprintf(tb, ",%g", shape->z);
+	if (shape->type == CIRCLE_SHAPE || shape->type == SPHERE_SHAPE) outprintf(tb, " radius %g", shape->radius);
+	if (shape->type == ELLIPSE_SHAPE)
+		outprintf(tb, " angle %d axes %g,%g", shape->angle, shape->semimajor, shape->semiminor);
+	outprintf(tb, "\n");
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+
+// Decoded contents of one CIVIC string (used where the globals above can't be, e.g. when decoding in parallel).
+// Strings point into heap, which is sized before decoding starts, and reused for the next record.
+
+typedef struct civic_record {
+	char country_code[3];
+	char const *CA[MAX_CA_TYPE+1];	// NULL where CA type not present
+	int mapmemetype;
+	char const *mapimagestring;		// NULL if there is no MAP_IMAGE subelement
+	char const *locationreference;	// NULL if there is no LOCATION_REFERENCE subelement
+	const location_shape *shapes;	// one per LOCATION_SHAPE subelement
+	int nshapes;
+	char *heap;						// space for CA values, map URL and location reference
+	int heapsize;
+	int heapused;
+	location_shape *shapespace;		// space for decoded shapes...
+	int shapesize;
+	float *vertexspace;				// ... and their coordinates
+	int vertexsize;
+	int vertexused;
+} civic_record;
+
+void initCivicRecord (civic_record *rec) {
+	memset(rec, 0, sizeof(civic_record));
+}
+
+void clearCivicRecord (civic_record *rec) {	// keeps heap for reuse
+	memset(rec->country_code, 0, sizeof(rec->country_code));
+	memset(rec->CA, 0, sizeof(rec->CA));
+	rec->mapmemetype = URL_DEFINED;
+	rec->mapimagestring = NULL;
+	rec->locationreference = NULL;
+	rec->shapes = rec->shapespace;
+	rec->nshapes = 0;
+	rec->heapused = 0;
+	rec->vertexused = 0;
+}
+
+void freeCivicRecord (civic_record *rec) {
+	free(rec->heap);
+	free(rec->shapespace);
+	free(rec->vertexspace);
+	initCivicRecord(rec);
+}
+
+// Make sure heap can hold all strings in a CIVIC string of slen bytes (so pointers into heap remain valid).
+// Each string has at least a two byte header, which leaves room for its null terminator.
+// Similarly, each shape takes at least 11 bytes, and each coordinate 4 bytes.
+
+void reserveCivicRecord (civic_record *rec, int slen) {
+	if (slen + 1 > rec->heapsize) {
+		free(rec->heap);
+		rec->heapsize = slen + 1;
+		rec->heap = (char *) malloc(rec->heapsize);
+		if (rec->heap == NULL) exit(1);
+	}
+	if (slen / 11 + 1 > rec->shapesize) {
+		free(rec->shapespace);
+		rec->shapesize = slen / 11 + 1;
+		rec->shapespace = (location_shape *) malloc(rec->shapesize * sizeof(location_shape));
+		if (rec->shapespace == NULL) exit(1);
+		rec->shapes = rec->shapespace;
+	}
+	if (slen / 4 + 2 * MAX_POLYGON_POINTS > rec->vertexsize) {	// (room for one polygon in addition)
+		free(rec->vertexspace);
+		rec->vertexsize = slen / 4 + 2 * MAX_POLYGON_POINTS;
+		rec->vertexspace = (float *) malloc(rec->vertexsize * sizeof(float));
+		if (rec->vertexspace == NULL) exit(1);
+	}
+}
+
+char *heapstring(civic_record *rec, const char *str, int nbyt, int nlen) {
+	char *text = rec->heap + rec->heapused;
+	for (int k = 0; k < nlen; k++)
+		text[k] =  (char) getoctet(str, nbyt++);
+	text[nlen] = '\0';	// null terminate
+	rec->heapused += nlen + 1;
+	return text;
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+
 void checksettings (void) {
 	if (strlen(country_code) != 2) {
 		printf("ERROR: country code %s should be two letters, not %d\n", country_code,strlen(country_code));
@@ -495,6 +841,63 @@ const char *civic2="01000b0011223344556677889900998877665544332211aabbccddeeff";
 
 ///////////////////////////////////////////////////////////////////////////////
 
+// Location shape from command line: <shape>:<comma separated numbers>, e.g. -shape=polygon:0,0,4,0,4,3,0,3
+// point:x,y  point3d:x,y,z  circle:x,y,radius  sphere:x,y,z,radius  polygon:x1,y1,x2,y2,...
+// ellipse:x,y,angle,semimajor,semiminor
+
+int parseLocationShape (const char *str, location_shape *shape) {
+	const char *colon = strchr(str, ':');
+	memset(shape, 0, sizeof(location_shape));
+	if (colon == NULL || (shape->type = encode_shape_type_string(str, (int) (colon - str))) < 0) {
+		printf("ERROR: don't understand location shape %s\n", str);
+		return -1;
+	}
+	int n = 1;
+	for (const char *p = colon + 1; *p != '\0'; p++) if (*p == ',') n++;
+	float *v = (float *) malloc(n * sizeof(float));
+	if (v == NULL) exit(1);
+	const char *p = colon + 1;
+	for (int k = 0; k < n; k++) {
+		char *end;
+		v[k] = (float) strtod(p, &end);
+		if (end == p || (*end != ',' && *end != '\0')) {
+			printf("ERROR: bad number \"%.*s\" in location shape %s\n", (int) strcspn(p, ","), p, str);
+			free(v);
+			return -1;
+		}
+		p = end + 1;
+	}
+	shape->xy = v;
+	shape->npoints = 1;
+	int need = 0;
+	switch (shape->type) {
+		case POINT_2D_SHAPE: need = 2; break;
+		case POINT_3D_SHAPE: need = 3; shape->z = v[2 % n]; break;
+		case CIRCLE_SHAPE: need = 3; shape->radius = v[2 % n]; break;
+		case SPHERE_SHAPE: need = 4; shape->z = v[2 % n]; shape->radius = v[3 % n]; break;
+		case POLYGON_SHAPE:
+			if (n % 2 != 0 || n < 6 || n > 2 * MAX_POLYGON_POINTS) {
+				printf("ERROR: location shape %s needs an even count of 6 to %d numbers (3 to %d points), not %d\n",
+					   str, 2 * MAX_POLYGON_POINTS, MAX_POLYGON_POINTS, n);
+				free(v);
+				shape->xy = NULL;
+				return -1;
+			}
+			need = n; shape->npoints = n / 2; break;
+		case ELLIPSE_SHAPE: need = 5;
+			shape->angle = (int) v[2 % n]; shape->semimajor = v[3 % n]; shape->semiminor = v[4 % n]; break;
+		default: break;
+	}
+	if (need == 0) printf("ERROR: location shape %s not supported\n", str);
+	else if (n != need) printf("ERROR: location shape %s needs %d numbers, not %d\n", str, need, n);
+	if (n != need) {
+		free(v);
+		shape->xy = NULL;
+		return -1;
+	}
+	return 0;
+}
+
 void showusage(void) {
 	printf("-v\t\tFlip verbose mode %s\n", verboseflag ? "off":"on");
 	printf("-t\t\tFlip trace mode %s\n", traceflag ? "off":"on");
@@ -502,6 +905,17 @@ void showusage(void) {
 	printf("-c\t\tFlip checking mode %s\n", checkflag ? "off":"on");
 	printf("\n");
 	printf("-civic=...\tDecode given CIVIC string\n");
+	printf("-file=...\tDecode CIVIC strings in given file (one per line) in parallel\n");
+	printf("-threads=...\tNumber of threads for -file=... (default one per core)\n");
+	printf("-stream\t\tDecode CIVIC strings from stdin as they arrive (one per line)\n");
+	printf("-raw\t\tInput for -stream is one CIVIC string in raw octets (not hex)\n");
+	printf("-chunk=...\tBytes to read at a time for -stream\n");
+	printf("-budget=...\tMost octets accepted in one CIVIC string when decoding (default no limit)\n");
+	printf("-export=...\tWrite decoded -file=... to given columnar binary (corpus) file instead\n");
+	printf("-corpus=...\tLoad given corpus file and show summary\n");
+	printf("-column=...\tList values of given CA key in -corpus=... (e.g. -column=floor)\n");
+	printf("-watch=...\tCheck civic=/lci= lines in hostapd.conf files in given directory as they change\n");
+	printf("-match=...\tFiles to check in -watch=... directory (default *.conf)\n");
 	printf("\n");
 	printf("To encode a CIVIC string use the CA keys and strings, for example:\n");
 	printf("\n");
@@ -509,8 +923,12 @@ void showusage(void) {
 	printf("\n");
 	printf("-map=<URI>\t(including file extension)\n");
 	printf("-meme=...\tmeme type (if not obvious from file extension)\n");
+	printf("-reference=...\tLocation reference (reference point for location shapes)\n");
+	printf("-shape=...\tLocation shape, e.g. -shape=polygon:0,0,4,0,4,3,0,3 (may be repeated)\n");
+	printf("\t\t(also point:x,y point3d:x,y,z circle:x,y,r sphere:x,y,z,r ellipse:x,y,angle,a,b)\n");
 	printf("\n");
 	printf("-sample\t\tShow example decoding / encoding\n");
+	printf("-test=...\tRound trip self test with given number of random records (uses -threads=...)\n");
 	printf("-?\t\tPrint this command line argument summary\n");
 	printf("-version=...\t%s\n", version);
 	fflush(stdout);
@@ -542,8 +960,33 @@ int commandline(int argc, const char *argv[]) {
 		else if (strcmp(arg, "-d") == 0) debugflag = !debugflag;
 		else if (strcmp(arg, "-c") == 0) checkflag = !checkflag;
 		else if (strcmp(arg, "-sample") == 0) sampleflag = !sampleflag;
+		else if (strcmp(arg, "-stream") == 0) streamflag = !streamflag;
+		else if (strcmp(arg, "-test") == 0) ntests = 1000000;
+		else if (_strnicmp(arg, "-test=", 6) == 0)
+			ntests = atoll(arg+6);
+		else if (strcmp(arg, "-raw") == 0) rawflag = !rawflag;
+		else if (_strnicmp(arg, "-chunk=", 7) == 0)
+			chunksize = atoi(arg+7);
+		else if (_strnicmp(arg, "-budget=", 8) == 0)
+			civicbudget = atoi(arg+8);
 		else if (_strnicmp(arg, "-civic=", 7) == 0) 	// string to decode (uc or lc)
 			civicstring = grabstring(arg);
+		else if (_strnicmp(arg, "-file=", 6) == 0) 		// file of strings to decode
+			civicfile = grabstring(arg);
+		else if (_strnicmp(arg, "-threads=", 9) == 0)
+			nthreads = atoi(arg+9);
+		else if (_strnicmp(arg, "-export=", 8) == 0)		// corpus file to write
+			exportfile = grabstring(arg);
+		else if (_strnicmp(arg, "-watch=", 7) == 0)		// directory of hostapd.conf files
+			watchdir = grabstring(arg);
+		else if (_strnicmp(arg, "-match=", 7) == 0)		// pattern for files in -watch=... directory
+			watchpattern = grabstring(arg);
+		else if (_strnicmp(arg, "-corpus=", 8) == 0)		// corpus file to read
+			corpusfile = grabstring(arg);
+		else if (_strnicmp(arg, "-column=", 8) == 0) {	// CA key to list from corpus
+			corpuscolumn = encode_CA_type_string(arg+8, strlen(arg+8));
+			if (corpuscolumn < 0 || corpuscolumn > MAX_CA_TYPE) printf("ERROR: %s unknown\n", arg);
+		}
 //		paramater for construction of civic element
 		else if (_strnicmp(arg, "-map=", 5) == 0)		// MAP URL with extension
 			mapimagestring = grabstring(arg);
@@ -553,6 +996,13 @@ int commandline(int argc, const char *argv[]) {
 			mapmemetype = encode_map_meme_type(arg+6);
 		else if (_strnicmp(arg, "-mapmeme=", 9) == 0)	// map meme type
 			mapmemetype = encode_map_meme_type(arg+9);
+		else if (_strnicmp(arg, "-reference=", 11) == 0)	// location reference
+			locationreference = grabstring(arg);
+		else if (_strnicmp(arg, "-shape=", 7) == 0) {		// location shape
+			locationshapes = (location_shape *) realloc(locationshapes, (nlocationshapes + 1) * sizeof(location_shape));
+			if (locationshapes == NULL) exit(1);
+			if (parseLocationShape(arg+7, &locationshapes[nlocationshapes]) == 0) nlocationshapes++;
+		}
 		else if (_strnicmp(arg, "-country=", 9) == 0)
 			country_code = grabstring(arg);
 		else if (_strnicmp(arg, "-country_code=", 14) == 0)
@@ -582,14 +1032,19 @@ int commandline(int argc, const char *argv[]) {
 
 ///////////////////////////////////////////////////////////////////////////////////////////////
 
-void showCivicValues () {
-	printf("Location Civic Keys and Values:\n");
+void showCivicRecordValues (char const * const *values, textbuf *tb) {
+	outprintf(tb, "Location Civic Keys and Values:\n");
 	for (int k = 0; k <= MAX_CA_TYPE; k++) {
-		if (CA[k] == NULL) continue;
-		printf("%3d\t\"%s\"\t(%s)\n", k, CA[k], CA_type_string(k));
+		if (values[k] == NULL) continue;
+		const char *key = CA_type_string(k);
+		outprintf(tb, "%3d\t\"%s\"\t(%s)\n", k, values[k], key != NULL ? key : "(null)");
 	}
 }
 
+void showCivicValues () {
+	showCivicRecordValues(CA, NULL);
+}
+
 int lengthCivicValues () {	// compute number of bytes needed to encode CA values
 	int nlen=0;
 	for (int k = 0; k <= MAX_CA_TYPE; k++) {
@@ -599,63 +1054,263 @@ int lengthCivicValues () {	// compute number of bytes needed to encode CA values
 	return nlen;
 }
 
-char *encodeCivicString () {
-	int nlen, alen, slen;
-	int nbyt = 0; 
-	int mlen = 0;
-	int clen = 0;
-	if (mapimagestring != NULL) // is there a map URL to encode ?
-		mlen = strlen(mapimagestring);	
-	if (mlen > 0) mlen += 3;	// add 3 bytes for subelement header
-	clen = lengthCivicValues();	// are there any civic location strings to encode ?
-	if (clen > 0) clen += 4;	// add 2 bytes for country code + 2 byte subelement header
-	slen = clen + mlen;			// total space needed
-	if (slen == 0) return NULL;	// nothing to do
-	alen = 3 + slen;			// add space of 3 bytes for Measurement Report "header"
-	if (traceflag) printf("clen %d mlen %d slen %d alen %d\n", clen, mlen, slen, alen);
-	char *civicstr = (char *) malloc(alen * 2 + 1);	
-	if (civicstr == NULL) exit(1);
+// Encoding a civic_record into a caller supplied buffer, without any allocation.
+// First call sizeCivicRecord() to find exact number of bytes needed, then encodeCivicRecord() to fill them in.
+// Output is either hexadecimal characters (as in hostapd.conf) or raw octets (as sent over the air).
+// Errors are reported to tb (or stdout if tb is NULL), as for decodeCivicRecord().
+
+#define MAX_FIELD_LENGTH 255	// largest value that fits in a length octet
+
+int INLINE putbyte(char *buf, int nbyt, int oct, int rawflag) {
+	if (rawflag) {
+		buf[nbyt] = (char) oct;
+		return nbyt + 1;
+	}
+	return putoctet(buf, nbyt, oct & 0xFF);
+}
+
+int putbytestring(char *buf, int nbyt, int nlen, const char *line, int rawflag) {
+	if (rawflag) {
+		memcpy(buf + nbyt, line, nlen);
+		return nbyt + nlen;
+	}
+	for (int k = 0; k < nlen; k++)
+		nbyt = putoctet(buf, nbyt, (BYTE) line[k]);
+	return nbyt;
+}
+
+int putfloat(char *buf, int nbyt, float f, int rawflag) {	// little-endian
+	uint32_t u;
+	memcpy(&u, &f, sizeof(u));
+	for (int k = 0; k < 4; k++)
+		nbyt = putbyte(buf, nbyt, (u >> (8 * k)) & 0xFF, rawflag);
+	return nbyt;
+}
+
+// Length of contents of LOCATION_SHAPE subelement for shape (or -1 if it can't be encoded)
+
+int locationShapeLength (const location_shape *shape, textbuf *tb) {
+	int vlen = shapeValueLength(shape->type, shape->npoints);
+	if (vlen < 0) {
+		outprintf(tb, "ERROR: location shape %d not supported\n", shape->type);
+		return -1;
+	}
+	if (shape->type == POLYGON_SHAPE && (shape->npoints < 3 || shape->npoints > MAX_POLYGON_POINTS)) {
+		outprintf(tb, "ERROR: polygon with %d points (should be 3 to %d)\n", shape->npoints, MAX_POLYGON_POINTS);
+		return -1;
+	}
+	if (shape->type == ELLIPSE_SHAPE && (shape->angle < 0 || shape->angle > 0xFFFF)) {
+		outprintf(tb, "ERROR: ellipse angle %d does not fit in two octets\n", shape->angle);
+		return -1;
+	}
+	if (shape->xy == NULL) {
+		outprintf(tb, "ERROR: location shape %s without coordinates\n", shape_type_string(shape->type));
+		return -1;
+	}
+	return 1 + vlen;	// Location Shape ID + value
+}
+
+// Bulk encoding of shapes (e.g. all the room outlines on a floor map), one LOCATION_SHAPE subelement each.
+// Exact number of bytes needed (hex characters if !rawflag), or -1 if any shape can't be encoded.
+
+int sizeLocationShapes (const location_shape *shapes, int nshapes, int rawflag, textbuf *tb) {
+	int slen = 0;
+	for (int i = 0; i < nshapes; i++) {
+		int nlen = locationShapeLength(&shapes[i], tb);
+		if (nlen < 0) return -1;
+		slen += nlen + 2;	// subelement header
+	}
+	return rawflag ? slen : slen * 2;
+}
+
+// Pack shapes starting at octet nbyt of buf (shapes and space already checked), coordinates taken straight
+// from the caller's arrays (no copying or allocation per vertex). Returns next nbyt.
+
+int putLocationShapes (char *buf, int nbyt, const location_shape *shapes, int nshapes, int rawflag) {
+	for (int i = 0; i < nshapes; i++) {
+		const location_shape *shape = &shapes[i];
+		nbyt = putbyte(buf, nbyt, LOCATION_SHAPE_CIVIC, rawflag);			// subelement ID
+		nbyt = putbyte(buf, nbyt, 1 + shapeValueLength(shape->type, shape->npoints), rawflag);	// length
+		nbyt = putbyte(buf, nbyt, shape->type, rawflag);					// Location Shape ID
+		if (shape->type == POLYGON_SHAPE) nbyt = putbyte(buf, nbyt, shape->npoints, rawflag);
+		for (int k = 0; k < 2 * shape->npoints; k++)
+			nbyt = putfloat(buf, nbyt, shape->xy[k], rawflag);
+		switch (shape->type) {
+			case POINT_3D_SHAPE:
+				nbyt = putfloat(buf, nbyt, shape->z, rawflag);
+				break;
+			case CIRCLE_SHAPE:
+				nbyt = putfloat(buf, nbyt, shape->radius, rawflag);
+				break;
+			case SPHERE_SHAPE:
+				nbyt = putfloat(buf, nbyt, shape->z, rawflag);
+				nbyt = putfloat(buf, nbyt, shape->radius, rawflag);
+				break;
+			case ELLIPSE_SHAPE:
+				nbyt = putbyte(buf, nbyt, shape->angle & 0xFF, rawflag);
+				nbyt = putbyte(buf, nbyt, shape->angle >> 8, rawflag);
+				nbyt = putfloat(buf, nbyt, shape->semimajor, rawflag);
+				nbyt = putfloat(buf, nbyt, shape->semiminor, rawflag);
+				break;
+			default:
+				break;
+		}
+	}
+	return nbyt;
+}
+
+// Encode shapes into buf (buflen bytes). Does not null terminate. Never allocates.
+// Returns number of bytes written, or -1 if a shape can't be encoded or buffer is too small.
+
+int encodeLocationShapes (const location_shape *shapes, int nshapes, int rawflag, char *buf, int buflen, textbuf *tb) {
+	int nlen = sizeLocationShapes(shapes, nshapes, rawflag, tb);
+	if (nlen < 0) return -1;
+	if (nlen > buflen) {
+		outprintf(tb, "ERROR: buffer of %d bytes too small for %d\n", buflen, nlen);
+		return -1;
+	}
+	int nbyt = putLocationShapes(buf, 0, shapes, nshapes, rawflag);
+	return rawflag ? nbyt : nbyt * 2;
+}
+
+// Lengths of contents of LOCATION_CIVIC, LOCATION_REFERENCE and MAP_IMAGE subelements (-1 if not present),
+// and total length of LOCATION_SHAPE subelements (including their headers).
+// Returns -1 if a CA value or a subelement does not fit in its length octet (rather than truncating it).
+
+int civicSubelementLengths (const civic_record *rec, int *clen, int *rlen, int *shlen, int *mlen, textbuf *tb) {
+	int nerr = 0;
+	*clen = -1;
+	*rlen = -1;
+	*mlen = -1;
+	*shlen = sizeLocationShapes(rec->shapes, rec->nshapes, 1, tb);
+	if (*shlen < 0) nerr++;
+	if (rec->locationreference != NULL) {
+		*rlen = (int) strlen(rec->locationreference);
+		if (*rlen > MAX_FIELD_LENGTH) {
+			outprintf(tb, "ERROR: LOCATION_REFERENCE subelement has %d bytes > %d\n", *rlen, MAX_FIELD_LENGTH);
+			nerr++;
+		}
+	}
+	for (int k = 0; k <= MAX_CA_TYPE; k++) {
+		if (rec->CA[k] == NULL) continue;
+		int nlen = (int) strlen(rec->CA[k]);
+		if (nlen > MAX_FIELD_LENGTH) {
+			outprintf(tb, "ERROR: CA type %d value has %d bytes > %d\n", k, nlen, MAX_FIELD_LENGTH);
+			nerr++;
+		}
+		if (*clen < 0) *clen = 2;	// country code
+		*clen += nlen + 2;			// one octet per character + key + length
+	}
+	if (*clen < 0 && rec->country_code[0] != '\0') *clen = 2;	// just country code
+	if (*clen > MAX_FIELD_LENGTH) {
+		outprintf(tb, "ERROR: LOCATION_CIVIC subelement has %d bytes > %d\n", *clen, MAX_FIELD_LENGTH);
+		nerr++;
+	}
+	if (rec->mapimagestring != NULL) {
+		*mlen = (int) strlen(rec->mapimagestring) + 1;	// meme type + URL
+		if (*mlen > MAX_FIELD_LENGTH) {
+			outprintf(tb, "ERROR: MAP_IMAGE subelement has %d bytes > %d\n", *mlen, MAX_FIELD_LENGTH);
+			nerr++;
+		}
+	}
+	if (rec->mapmemetype < 0 || rec->mapmemetype > 255) {
+		outprintf(tb, "ERROR: map meme type %d does not fit in an octet\n", rec->mapmemetype);
+		nerr++;
+	}
+	return (nerr > 0) ? -1 : 0;
+}
+
+// Size of encoded record from lengths found by civicSubelementLengths()
+
+int INLINE civicRecordLength (int clen, int rlen, int shlen, int mlen, int rawflag) {
+	int slen = 3;	// Measurement Report "header"
+	if (clen >= 0) slen += clen + 2;	// subelement header
+	if (rlen >= 0) slen += rlen + 2;	// subelement header
+	slen += shlen;
+	if (mlen >= 0) slen += mlen + 2;	// subelement header
+	return rawflag ? slen : slen * 2;
+}
+
+// Exact size of encoded record in bytes (hex characters if !rawflag), not counting any null terminator.
+// Returns -1 if record can't be encoded.
+
+int sizeCivicRecord (const civic_record *rec, int rawflag, textbuf *tb) {
+	int clen, rlen, shlen, mlen;
+	if (civicSubelementLengths(rec, &clen, &rlen, &shlen, &mlen, tb) < 0) return -1;
+	return civicRecordLength(clen, rlen, shlen, mlen, rawflag);
+}
+
+// Encode record into buf (buflen bytes). Does not null terminate. Never allocates.
+// Returns number of bytes written, or -1 if record can't be encoded or buffer is too small.
+
+int encodeCivicRecord (const civic_record *rec, int rawflag, char *buf, int buflen, textbuf *tb) {
+	int clen, rlen, shlen, mlen;
+	if (civicSubelementLengths(rec, &clen, &rlen, &shlen, &mlen, tb) < 0) return -1;
+	int nlen = civicRecordLength(clen, rlen, shlen, mlen, rawflag);
+	if (nlen > buflen) {
+		outprintf(tb, "ERROR: buffer of %d bytes too small for %d\n", buflen, nlen);
+		return -1;
+	}
+	int nbyt = 0;
 	// construct "header"
-	putoctet(civicstr, nbyt++, MEASURE_TOKEN);			// 1
-	putoctet(civicstr, nbyt++, MEASURE_REQUEST_MODE);	// 0
-	putoctet(civicstr, nbyt++, LOCATION_CIVIC_TYPE);	// 0x0b (Measurement Type Table 9-107)
-	if (clen > 0) {
-		putoctet(civicstr, nbyt++, LOCATION_CIVIC);		// sublement ID 
-		putoctet(civicstr, nbyt++, clen-2);				// overall length
-		puthexstring(civicstr, nbyt, 2, country_code);
-		nbyt += 2;
+	nbyt = putbyte(buf, nbyt, MEASURE_TOKEN, rawflag);			// 1
+	nbyt = putbyte(buf, nbyt, MEASURE_REQUEST_MODE, rawflag);	// 0
+	nbyt = putbyte(buf, nbyt, LOCATION_CIVIC_TYPE, rawflag);	// 0x0b (Measurement Type Table 9-107)
+	if (clen >= 0) {
+		nbyt = putbyte(buf, nbyt, LOCATION_CIVIC, rawflag);		// sublement ID
+		nbyt = putbyte(buf, nbyt, clen, rawflag);				// overall length
+		nbyt = putbytestring(buf, nbyt, 2, rec->country_code, rawflag);
 		for (int k = 0; k <= MAX_CA_TYPE; k++) {
-			if (CA[k] == NULL) continue;
-			if (traceflag) printf("k %d CA[k] %s\n", k, CA[k]);
-			nlen = strlen(CA[k]);
-			while (nbyt + nlen > alen) { // should not happen
-				printf("WARNING: have to extend allocation from %d bytes\n", alen);
-				alen = alen * 3 / 2;
-				civicstr = (char *) realloc(civicstr, alen * 2 + 1);
-				if (civicstr == NULL) exit(1);
-			}
-			if (traceflag) printf("nbyt %d nlen %d\n", nbyt, nlen);
-			putoctet(civicstr, nbyt++, k);		// key
-			putoctet(civicstr, nbyt++, nlen);	// length
-			puthexstring(civicstr, nbyt, nlen, CA[k]);
-			nbyt += nlen;
-			if (traceflag) printf("nbyt %d nlen %d\n", nbyt, nlen);
-		}
-	}
-	if (mlen > 0) {
-		putoctet(civicstr, nbyt++, MAP_IMAGE_CIVIC);	// subelement ID
-		putoctet(civicstr, nbyt++, mlen-3+1);			// length
-		putoctet(civicstr, nbyt++, mapmemetype);		// Map Meme Type (URL_DEFINED is default)
+			if (rec->CA[k] == NULL) continue;
+			int olen = (int) strlen(rec->CA[k]);
+			if (traceflag) outprintf(tb, "k %d CA[k] %s nbyt %d olen %d\n", k, rec->CA[k], nbyt, olen);
+			nbyt = putbyte(buf, nbyt, k, rawflag);		// key
+			nbyt = putbyte(buf, nbyt, olen, rawflag);	// length
+			nbyt = putbytestring(buf, nbyt, olen, rec->CA[k], rawflag);
+		}
+	}
+	if (rlen >= 0) {
+		nbyt = putbyte(buf, nbyt, LOCATION_REFERENCE_CIVIC, rawflag);	// subelement ID
+		nbyt = putbyte(buf, nbyt, rlen, rawflag);						// length
+		nbyt = putbytestring(buf, nbyt, rlen, rec->locationreference, rawflag);
+	}
+	nbyt = putLocationShapes(buf, nbyt, rec->shapes, rec->nshapes, rawflag);
+	if (mlen >= 0) {
+		nbyt = putbyte(buf, nbyt, MAP_IMAGE_CIVIC, rawflag);		// subelement ID
+		nbyt = putbyte(buf, nbyt, mlen, rawflag);					// length
+		nbyt = putbyte(buf, nbyt, rec->mapmemetype, rawflag);		// Map Meme Type (URL_DEFINED is default)
 		if (debugflag)
-			printf("mapimagestring %s (%d bytes)\n", mapimagestring, mlen-3);	// IETF RFC 3986
-		puthexstring(civicstr, nbyt, mlen-3, mapimagestring);
-		nbyt += mlen-3;
+			outprintf(tb, "mapimagestring %s (%d bytes)\n", rec->mapimagestring, mlen-1);	// IETF RFC 3986
+		nbyt = putbytestring(buf, nbyt, mlen-1, rec->mapimagestring, rawflag);
+	}
+	return rawflag ? nbyt : nbyt * 2;
+}
+
+// Encode CIVIC string from (global) country_code, CA[], locationreference, locationshapes, mapimagestring and mapmemetype.
+// Returns null terminated hex string (to be freed by caller), or NULL if nothing to encode.
+
+char *encodeCivicString () {
+	civic_record rec;
+	initCivicRecord(&rec);
+	if (lengthCivicValues() > 0) {	// are there any civic location strings to encode ?
+		rec.country_code[0] = country_code[0];
+		if (country_code[0] != '\0') rec.country_code[1] = country_code[1];
+		memcpy(rec.CA, CA, sizeof(rec.CA));
 	}
-	
-	if (nbyt != alen) {
-		printf("ERROR: nbyt %d alen %d\n", nbyt, alen);
+	if (mapimagestring != NULL && *mapimagestring != '\0') { // is there a map URL to encode ?
+		rec.mapimagestring = mapimagestring;
+		rec.mapmemetype = mapmemetype;
 	}
-	civicstr[nbyt * 2] = '\0';	// null terminate
+	rec.locationreference = locationreference;
+	rec.shapes = locationshapes;
+	rec.nshapes = nlocationshapes;
+	int nlen = sizeCivicRecord(&rec, 0, NULL);
+	if (traceflag) printf("nlen %d\n", nlen);
+	if (nlen <= 3 * 2) return NULL;	// nothing to do (or can't be done)
+	char *civicstr = (char *) malloc(nlen + 1);
+	if (civicstr == NULL) exit(1);
+	nlen = encodeCivicRecord(&rec, 0, civicstr, nlen, NULL);
+	civicstr[nlen] = '\0';	// null terminate
 	return civicstr;
 }
 
@@ -663,132 +1318,2059 @@ char *encodeCivicString () {
 // "For a given multi-octet numeric representation, the least significant octet has the lowest address."
 // but there are no multioctet numbers here in CIVIC ?
 
-void decodeCivicString(const char *str) {
-	int Map_Type = 0;
-	char *Map_URL = NULL;
+// Decode CIVIC string of slen bytes (2 * slen hex characters, need not be null terminated) into rec.
+// If budget > 0, only that many octets are accepted (as for the push decoder), the rest is an error.
+// Output goes to tb (or stdout if tb is NULL). Returns number of errors found.
+
+int decodeCivicRecord(const char *str, int slen, int budget, civic_record *rec, textbuf *tb) {
+	int nerr = 0;
 	int nbyt=0;
-	int slen = strlen(str)/2;
-	if (traceflag) printf("decode %s (%d bytes)\n", str, slen);
+	if (budget > 0 && slen > budget) {
+		outprintf(tb, "ERROR: CIVIC string longer than budget of %d bytes at nbyt %d\n", budget, budget);
+		nerr++;
+		slen = budget;	// decode what fits
+	}
+	clearCivicRecord(rec);
+	reserveCivicRecord(rec, slen);
+	if (traceflag) outprintf(tb, "decode %.*s (%d bytes)\n", slen*2, str, slen);
+	if (slen < 3) {
+		outprintf(tb, "ERROR: CIVIC string too short (%d bytes)\n", slen);
+		return nerr + 1;
+	}
 	int a = getoctet(str, nbyt++);	// 01 MEASURE_TOKEN
 	int b = getoctet(str, nbyt++);	// 00 MEASURE_REQUEST_MODE
 	int c = getoctet(str, nbyt++);	// 0B (LOCATION_CIVIC_TYPE) (Measurement Type Table 9-107)
-	if (a != MEASURE_TOKEN || b != MEASURE_REQUEST_MODE || c != LOCATION_CIVIC_TYPE)
-		printf("ERROR: Bad Measurement Element Type %02X %02X %02X\n", a, b, c);
-	while (nbyt < slen && str[nbyt] != '\0') {
-		int ID = getoctet(str, nbyt++);		// ID 
+	if (a != MEASURE_TOKEN || b != MEASURE_REQUEST_MODE || c != LOCATION_CIVIC_TYPE) {
+		outprintf(tb, "ERROR: Bad Measurement Element Type %02X %02X %02X\n", a, b, c);
+		nerr++;
+	}
+	while (nbyt + 2 <= slen) {
+		int ID = getoctet(str, nbyt++);		// ID
 		int nlen = getoctet(str, nbyt++);	// length
-		if (traceflag) printf("ID %d nlen %d nbyt %d slen %d\n", ID, nlen, nbyt, slen);
+		if (traceflag) outprintf(tb, "ID %d nlen %d nbyt %d slen %d\n", ID, nlen, nbyt, slen);
 		if (nbyt + nlen > slen) {	// don't try and parse past end of string
-			printf("ERROR: bad length code ID %d (0x%02X) nlen %d (0x%02X) at nbyt %d slen %d\n", 
+			outprintf(tb, "ERROR: bad length code ID %d (0x%02X) nlen %d (0x%02X) at nbyt %d slen %d\n",
 				   ID, ID, nlen, nlen, nbyt-1, slen);
+			nerr++;
+			nbyt = slen;
 			break;
 		}
 		switch(ID) {
-			case LOCATION_CIVIC:
-				nlen += 5;	// take into account header 
-				country_code = gethexstring(str, nbyt, 2);
-				nbyt += 2;
-				if ((country_code[0] < 'A' || country_code[0] > 'Z') &&
-					  (country_code[0] < 'a' || country_code[0] > 'z')) {
-					printf("ERROR: bad country code %s\n", country_code);
+			case LOCATION_CIVIC: {
+				int send = nbyt + nlen;	// end of subelement
+				if (nlen < 2) {
+					outprintf(tb, "ERROR: no room for country code in subelement of %d bytes\n", nlen);
+					nerr++;
+					nbyt = send;
+					break;
 				}
-				else printf("\t\"%s\"\t(COUNTRY CODE)\n", country_code);
-				while (nbyt < nlen && str[nbyt] != '\0') {
-					if (traceflag) printf("nbyt %d nlen %d str[nbyt] %d\n", nbyt, nlen, str[nbyt]);
+				rec->country_code[0] = (char) getoctet(str, nbyt++);
+				rec->country_code[1] = (char) getoctet(str, nbyt++);
+				if ((rec->country_code[0] < 'A' || rec->country_code[0] > 'Z') &&
+					  (rec->country_code[0] < 'a' || rec->country_code[0] > 'z')) {
+					outprintf(tb, "ERROR: bad country code %s\n", rec->country_code);
+					nerr++;
+				}
+				else outprintf(tb, "\t\"%s\"\t(COUNTRY CODE)\n", rec->country_code);
+				while (nbyt + 2 <= send) {
+					if (traceflag) outprintf(tb, "nbyt %d send %d\n", nbyt, send);
 					ID = getoctet(str, nbyt++);		// subelement ID
 					int olen = getoctet(str, nbyt++);	// subelement field length
-					if (nbyt + olen > slen) {
-						printf("ERROR: bad length code ID %d (0x%02X) olen %d (0x%02X) at nbyt %d slen %d\n",
+					if (nbyt + olen > send) {
+						outprintf(tb, "ERROR: bad length code ID %d (0x%02X) olen %d (0x%02X) at nbyt %d slen %d\n",
 							   ID, ID, olen, olen, nbyt-1, slen);
+						nerr++;
 						nbyt = slen;	// force exit of outer while loop
 						break;
 					}
-					char *text = gethexstring(str, nbyt, olen);
+					char *text = heapstring(rec, str, nbyt, olen);
 					nbyt += olen;
-					if (traceflag) printf("%d\t%s\n", ID, text);
-					if (ID >= 0 && ID <= MAX_CA_TYPE) {
-						CA[ID] = text;
-						if (CA_type_string(ID) == NULL)
-							printf("WARNING: unknown CA type ID %d (0x%02X) olen %d (0x%02X) at nbyt %d\n",
-								   ID, ID, olen, olen, nbyt-olen-2);
-					}
+					if (traceflag) outprintf(tb, "%d\t%s\n", ID, text);
+					rec->CA[ID] = text;		// ID is an octet, so always <= MAX_CA_TYPE
+					if (CA_type_string(ID) == NULL)
+						outprintf(tb, "WARNING: unknown CA type ID %d (0x%02X) olen %d (0x%02X) at nbyt %d\n",
+							   ID, ID, olen, olen, nbyt-olen-2);
 				}
-				showCivicValues();
+				if (nbyt < send) {	// e.g. 01000b0003555303... (CA type without room for its length)
+					outprintf(tb, "ERROR: %d byte(s) left over in subelement at nbyt %d\n", send - nbyt, nbyt);
+					nerr++;
+				}
+				showCivicRecordValues(rec->CA, tb);
+				nbyt = send < nbyt ? nbyt : send;
 				break;
-				
-			case MAP_IMAGE_CIVIC: 
-				Map_Type = getoctet(str, nbyt++);
-				Map_URL = gethexstring(str, nbyt, nlen-1);
+			}
+
+			case MAP_IMAGE_CIVIC:
+				if (nlen < 1) {
+					outprintf(tb, "ERROR: no room for map meme type in subelement of %d bytes\n", nlen);
+					nerr++;
+					break;
+				}
+				rec->mapmemetype = getoctet(str, nbyt++);
+				rec->mapimagestring = heapstring(rec, str, nbyt, nlen-1);
 				nbyt += nlen-1;
-				printf("Map URL: %s\n", Map_URL);
-				printf("Map Meme: %s\n", map_meme_type_string(Map_Type));
+				outprintf(tb, "Map URL: %s\n", rec->mapimagestring);
+				outprintf(tb, "Map Meme: %s\n", map_meme_type_string(rec->mapmemetype));
+				break;
+
+			case LOCATION_REFERENCE_CIVIC:
+				rec->locationreference = heapstring(rec, str, nbyt, nlen);
+				nbyt += nlen;
+				outprintf(tb, "Location Reference: %s\n", rec->locationreference);
+				break;
+
+			case LOCATION_SHAPE_CIVIC: {
+				BYTE body[MAX_FIELD_LENGTH];
+				for (int k = 0; k < nlen; k++) body[k] = (BYTE) getoctet(str, nbyt++);
+				location_shape *shape = &rec->shapespace[rec->nshapes];
+				if (decodeLocationShape(body, nlen, shape, rec->vertexspace + rec->vertexused, tb) > 0) {
+					nerr++;
+					break;
+				}
+				rec->nshapes++;
+				rec->vertexused += 2 * shape->npoints;
+				showLocationShape(shape, tb);
 				break;
-				
+			}
+
 			default:
-				printf("ERROR: unknown subelement ID %d (nbyt %d)\n", ID, nbyt-2);
+				outprintf(tb, "ERROR: unknown subelement ID %d (nbyt %d)\n", ID, nbyt-2);
+				nerr++;
 				nbyt += nlen;
 				break;
 		}
 	}
-	if (debugflag) printf("End of decoding byte %d slen %d\n", nbyt, slen);
-}
-
-void doExample(void) {
-	const char *civicstr = "01000b001d555301024d41030943616d627269646765130233322206566173736172";
-	printf("-civic=%s\n", civicstr);
-	decodeCivicString(civicstr);
-	char *str = encodeCivicString();
-	printf("-civic=%s\n", str);
-	free(str);
+	if (nbyt < slen) {
+		outprintf(tb, "ERROR: %d byte(s) left over at nbyt %d slen %d\n", slen - nbyt, nbyt, slen);
+		nerr++;
+	}
+	if (debugflag) outprintf(tb, "End of decoding byte %d slen %d\n", nbyt, slen);
+	return nerr;
 }
 
-/////////////////////////////////////////////////////////////////////////////////////////
+// Decode null terminated CIVIC string, leaving results in (global) country_code, CA[], mapimagestring,
+// mapmemetype, locationreference and locationshapes (so encodeCivicString() can encode it again)
 
-void freeCivicValues () {
+void decodeCivicString(const char *str) {
+	civic_record rec;
+	initCivicRecord(&rec);
+	decodeCivicRecord(str, strlen(str)/2, civicbudget, &rec, NULL);
+	if (rec.country_code[0] != '\0') country_code = strndup(rec.country_code, 2);
 	for (int k = 0; k <= MAX_CA_TYPE; k++) {
-		if (CA[k] == NULL) continue;
-		free((void *) CA[k]);
-		CA[k] = NULL;
+		if (rec.CA[k] == NULL) continue;
+		CA[k] = strndup(rec.CA[k], strlen(rec.CA[k]));
 	}
-	free(CA);
-	CA = NULL;
+	if (rec.mapimagestring != NULL) {
+		mapimagestring = strndup(rec.mapimagestring, strlen(rec.mapimagestring));
+		mapmemetype = rec.mapmemetype;
+	}
+	if (rec.locationreference != NULL)
+		locationreference = strndup(rec.locationreference, strlen(rec.locationreference));
+	if (rec.nshapes > 0) {	// copy, since coordinates live in rec
+		locationshapes = (location_shape *) realloc(locationshapes, (nlocationshapes + rec.nshapes) * sizeof(location_shape));
+		if (locationshapes == NULL) exit(1);
+		for (int i = 0; i < rec.nshapes; i++) {
+			location_shape *shape = &locationshapes[nlocationshapes++];
+			*shape = rec.shapes[i];
+			float *xy = (float *) malloc(2 * shape->npoints * sizeof(float));
+			if (xy == NULL) exit(1);
+			memcpy(xy, rec.shapes[i].xy, 2 * shape->npoints * sizeof(float));
+			shape->xy = xy;
+		}
+	}
+	freeCivicRecord(&rec);
 }
 
-void initialize_arrays (void) {
-	CA = (char const **) malloc((MAX_CA_TYPE+1) * sizeof(char *));	// place for civic location values
-	if (CA == NULL) exit(1);
-//	for (int k = 0; k <= MAX_CA_TYPE; k++) CA[k] = NULL;	// or...
-	memset(CA, 0, (MAX_CA_TYPE+1) * sizeof(char *));
+/////////////////////////////////////////////////////////////////////////////////////////
+
+// Incremental ("push") decoder for CIVIC strings arriving in pieces of arbitrary size (e.g. from a pipe or socket).
+// State is kept across pieces - in the middle of an octet (hex), a subelement, or a CA value.
+// Each field is handed to a callback as soon as its last octet arrives.
+// Memory use is fixed: no value can be longer than 255 octets, so one buffer of that size is enough.
+// The number of octets accepted for one CIVIC string can be limited by budget (-budget=..., same as batch decoder).
+// Hex input: a newline ends a CIVIC string (a leading civic= or -civic= is ignored, lines starting with # are skipped).
+// Raw input: caller signals end of each CIVIC string using civicPushEnd().
+
+#define COUNTRY_FIELD (-1)			// field type for country code (otherwise CA type or map meme type)
+#define NO_PUSH_BUDGET 0x7FFFFFFE	// no limit on octets in one CIVIC string (but count can't overflow)
+
+// Called with subelement ID, field type (CA type, map meme type, or COUNTRY_FIELD), and value (null terminated).
+// Location Shape bodies are checked (errors counted) before they are handed over, so they always decode.
+typedef void (*civic_field_callback) (void *context, int subelement, int type, const char *value, int nlen);
+
+// Called at end of each CIVIC string with number of errors found in it
+typedef void (*civic_end_callback) (void *context, int nerr);
+
+enum push_state {
+	PUSH_HEADER,		// Measurement Report "header" (3 octets)
+	PUSH_SUB_ID,		// subelement ID
+	PUSH_SUB_LEN,		// subelement length
+	PUSH_COUNTRY,		// country code (2 octets) of LOCATION_CIVIC subelement
+	PUSH_CA_TYPE,		// CA type
+	PUSH_CA_LEN,		// CA value length
+	PUSH_CA_VALUE,		// CA value
+	PUSH_MEME,			// map meme type of MAP_IMAGE subelement
+	PUSH_URL,			// map URL
+	PUSH_SUB_BODY,		// contents of other subelement
+	PUSH_SKIP,			// rest of subelement with error
+	PUSH_BAD			// rest of CIVIC string with error
+};
+
+typedef struct civic_push_decoder {
+	int rawflag;			// input is raw octets (rather than hex)
+	int budget;				// maximum octets accepted in one CIVIC string (NO_PUSH_BUDGET => no limit)
+	civic_field_callback field;
+	civic_end_callback end;
+	void *context;
+	textbuf *tb;			// for error messages (NULL => stdout)
+	int state;
+	int nbyt;				// octets in current CIVIC string so far
+	int nerr;				// errors in current CIVIC string so far
+	int header[3];
+	int subID;				// current subelement ID
+	int subleft;			// octets left in current subelement
+	int type;				// current CA type or map meme type
+	int valueleft;			// octets left in current value
+	int nvalue;				// octets in value so far
+	char value[MAX_FIELD_LENGTH+1];
+	int nibble;				// first hex digit of octet (-1 if none)
+	int linestart;			// (hex) at start of line, so civic= prefix possible
+	int comment;			// (hex) in comment line, skip to end of line
+	int nprefix;
+	char prefix[8];			// (hex) characters held back while they could be civic= prefix
+} civic_push_decoder;
+
+void initCivicPushDecoder (civic_push_decoder *pd, int rawflag, int budget,
+						   civic_field_callback field, civic_end_callback end, void *context, textbuf *tb) {
+	memset(pd, 0, sizeof(civic_push_decoder));
+	pd->rawflag = rawflag;
+	pd->budget = (budget > 0 && budget < NO_PUSH_BUDGET) ? budget : NO_PUSH_BUDGET;
+	pd->field = field;
+	pd->end = end;
+	pd->context = context;
+	pd->tb = tb;
+	pd->state = PUSH_HEADER;
+	pd->nibble = -1;
+	pd->linestart = 1;
 }
 
-int main(int argc, const char *argv[]) {
-	int firstarg = 1;
+void pushfield (civic_push_decoder *pd, int type) {
+	pd->value[pd->nvalue] = '\0';	// null terminate
+	if (pd->field != NULL) pd->field(pd->context, pd->subID, type, pd->value, pd->nvalue);
+	pd->nvalue = 0;
+}
 
-//	test_utf_unicode(0x200000); return 0;
-	initialize_arrays();
-	firstarg = commandline(argc, argv);
+void pusherror (civic_push_decoder *pd, int state, const char *format, ...) {
+	va_list args;
+	char msg[256];
+	va_start(args, format);
+	vsnprintf(msg, sizeof(msg), format, args);
+	va_end(args);
+	outprintf(pd->tb, "ERROR: %s at nbyt %d\n", msg, pd->nbyt-1);
+	pd->nerr++;
+	pd->state = state;
+}
 
-	int ncivic = lengthCivicValues();	// any command line arguments for constructing civic string?
-	if (debugflag) printf("ncivic %d bytes\n", ncivic);
-	if (ncivic > 0)	showCivicValues();
+// Whole body of LOCATION_REFERENCE, LOCATION_SHAPE (or unknown) subelement has arrived
 
-//	Is CIVIC string given on command line ?
-	if (civicstring != NULL) {
-		decodeCivicString(civicstring);
-		if (checkflag) {
-			printf("\n");
-			ncivic = lengthCivicValues();
-			char *str = encodeCivicString();
-			printf("-civic=%s\n", str);
-			free(str);
+void pushbody (civic_push_decoder *pd) {
+	if (pd->subID == LOCATION_SHAPE_CIVIC) {
+		location_shape shape;
+		float xy[2 * MAX_POLYGON_POINTS];
+		if (decodeLocationShape((const BYTE *) pd->value, pd->nvalue, &shape, xy, pd->tb) > 0) {
+			pd->nerr++;
+			pd->nvalue = 0;
+			return;
 		}
-//		return 0;
 	}
-//	Are arguments for constructing CIVIC string given on command line ?
-	else if (ncivic > 0 || mapimagestring != NULL) { 
-		char *str = encodeCivicString();
-		printf("-civic=%s\n", str);
-		if (checkflag) {
+	pushfield(pd, -1);
+}
+
+// Next subelement, or skip rest of current one
+
+void INLINE pushnext (civic_push_decoder *pd) {
+	pd->state = (pd->subleft > 0) ? PUSH_SKIP : PUSH_SUB_ID;
+}
+
+void pushoctet (civic_push_decoder *pd, int oct) {
+	if (pd->state == PUSH_BAD) return;
+	if (++pd->nbyt > pd->budget) {
+		pusherror(pd, PUSH_BAD, "CIVIC string longer than budget of %d bytes", pd->budget);
+		return;
+	}
+	switch (pd->state) {
+		case PUSH_HEADER:
+			pd->header[pd->nbyt-1] = oct;
+			if (pd->nbyt < 3) break;
+			if (pd->header[0] != MEASURE_TOKEN || pd->header[1] != MEASURE_REQUEST_MODE ||
+				pd->header[2] != LOCATION_CIVIC_TYPE) {
+				outprintf(pd->tb, "ERROR: Bad Measurement Element Type %02X %02X %02X\n",
+						  pd->header[0], pd->header[1], pd->header[2]);
+				pd->nerr++;
+			}
+			pd->state = PUSH_SUB_ID;
+			break;
+
+		case PUSH_SUB_ID:
+			pd->subID = oct;
+			pd->state = PUSH_SUB_LEN;
+			break;
+
+		case PUSH_SUB_LEN:
+			pd->subleft = oct;
+			pd->nvalue = 0;
+			if (pd->subID == LOCATION_CIVIC) {
+				if (pd->subleft < 2) pusherror(pd, PUSH_SKIP, "no room for country code in subelement of %d bytes", oct);
+				else pd->state = PUSH_COUNTRY;
+			}
+			else if (pd->subID == MAP_IMAGE_CIVIC) {
+				if (pd->subleft < 1) pusherror(pd, PUSH_SKIP, "no room for map meme type in subelement of %d bytes", oct);
+				else pd->state = PUSH_MEME;
+			}
+			else if (pd->subID == LOCATION_REFERENCE_CIVIC || pd->subID == LOCATION_SHAPE_CIVIC)
+				pd->state = PUSH_SUB_BODY;	// handed to callback as a whole
+			else {
+				pusherror(pd, PUSH_SUB_BODY, "unknown subelement ID %d", pd->subID);
+				pd->state = PUSH_SUB_BODY;
+			}
+			if (pd->subleft == 0) {	// empty subelement
+				if (pd->state == PUSH_SUB_BODY) pushbody(pd);
+				pd->state = PUSH_SUB_ID;
+			}
+			break;
+
+		case PUSH_COUNTRY:
+			pd->subleft--;
+			pd->value[pd->nvalue++] = (char) oct;
+			if (pd->nvalue < 2) break;
+			if ((pd->value[0] < 'A' || pd->value[0] > 'Z') && (pd->value[0] < 'a' || pd->value[0] > 'z')) {
+				outprintf(pd->tb, "ERROR: bad country code %.2s\n", pd->value);
+				pd->nerr++;
+			}
+			pushfield(pd, COUNTRY_FIELD);
+			pd->state = (pd->subleft > 0) ? PUSH_CA_TYPE : PUSH_SUB_ID;
+			break;
+
+		case PUSH_CA_TYPE:
+			pd->subleft--;
+			pd->type = oct;
+			if (pd->subleft > 0) pd->state = PUSH_CA_LEN;
+			else pusherror(pd, PUSH_SUB_ID, "no room for length of CA type %d", oct);
+			break;
+
+		case PUSH_CA_LEN:
+			pd->subleft--;
+			pd->valueleft = oct;
+			if (pd->valueleft > pd->subleft) {
+				pusherror(pd, PUSH_SKIP, "bad length code ID %d (0x%02X) olen %d (0x%02X)", pd->type, pd->type, oct, oct);
+				pushnext(pd);
+				break;
+			}
+			if (CA_type_string(pd->type) == NULL)
+				outprintf(pd->tb, "WARNING: unknown CA type ID %d (0x%02X) olen %d (0x%02X) at nbyt %d\n",
+						  pd->type, pd->type, oct, oct, pd->nbyt-2);
+			if (pd->valueleft > 0) {
+				pd->state = PUSH_CA_VALUE;
+				break;
+			}
+			pushfield(pd, pd->type);	// empty value
+			pd->state = (pd->subleft > 0) ? PUSH_CA_TYPE : PUSH_SUB_ID;
+			break;
+
+		case PUSH_CA_VALUE:
+			pd->subleft--;
+			pd->value[pd->nvalue++] = (char) oct;
+			if (--pd->valueleft > 0) break;
+			pushfield(pd, pd->type);
+			pd->state = (pd->subleft > 0) ? PUSH_CA_TYPE : PUSH_SUB_ID;
+			break;
+
+		case PUSH_MEME:
+			pd->subleft--;
+			pd->type = oct;
+			pd->state = PUSH_URL;
+			if (pd->subleft > 0) break;
+			pushfield(pd, pd->type);	// empty URL
+			pd->state = PUSH_SUB_ID;
+			break;
+
+		case PUSH_URL:
+		case PUSH_SUB_BODY:
+			pd->subleft--;
+			pd->value[pd->nvalue++] = (char) oct;
+			if (pd->subleft > 0) break;
+			if (pd->state == PUSH_URL) pushfield(pd, pd->type);
+			else pushbody(pd);
+			pd->state = PUSH_SUB_ID;
+			break;
+
+		case PUSH_SKIP:
+			if (--pd->subleft == 0) pd->state = PUSH_SUB_ID;
+			break;
+	}
+}
+
+// End of one CIVIC string: check that it is complete, and get ready for next. Returns number of errors in it.
+
+int civicPushEnd (civic_push_decoder *pd) {
+	if (pd->nibble >= 0) {
+		outprintf(pd->tb, "ERROR: odd number of hexadecimal chars\n");
+		pd->nerr++;
+	}
+	int nerr = pd->nerr;
+	if (pd->nbyt > 0 || nerr > 0) {	// (otherwise nothing there, e.g. blank line or comment)
+		if (pd->state == PUSH_HEADER) {
+			outprintf(pd->tb, "ERROR: CIVIC string too short (%d bytes)\n", pd->nbyt);
+			nerr++;
+		}
+		else if (pd->state != PUSH_SUB_ID && pd->state != PUSH_BAD) {
+			outprintf(pd->tb, "ERROR: CIVIC string ends inside subelement ID %d (%d bytes)\n", pd->subID, pd->nbyt);
+			nerr++;
+		}
+		if (pd->end != NULL) pd->end(pd->context, nerr);
+	}
+	pd->state = PUSH_HEADER;
+	pd->nbyt = 0;
+	pd->nerr = 0;
+	pd->nvalue = 0;
+	pd->nibble = -1;
+	pd->linestart = 1;
+	pd->comment = 0;
+	return nerr;
+}
+
+void pushhexchar (civic_push_decoder *pd, int c) {
+	if (c == ' ' || c == '\t' || c == '\r') return;
+	if (!ishexchar(c)) {
+		if (pd->state != PUSH_BAD) {
+			outprintf(pd->tb, "ERROR: non hexadecimal char %d at position %d\n", c, pd->nbyt * 2 + (pd->nibble >= 0));
+			pd->nerr++;
+			pd->state = PUSH_BAD;
+		}
+		return;
+	}
+	if (pd->nibble < 0) pd->nibble = hextoint(c);
+	else {
+		pushoctet(pd, (pd->nibble << 4) | hextoint(c));
+		pd->nibble = -1;
+	}
+}
+
+// Characters held back at start of line could still be civic= or -civic= prefix ?
+
+int INLINE pushprefixpossible (const civic_push_decoder *pd) {
+	return _strnicmp(pd->prefix, "civic=", pd->nprefix) == 0 || _strnicmp(pd->prefix, "-civic=", pd->nprefix) == 0;
+}
+
+void pushreplayprefix (civic_push_decoder *pd) {
+	int nprefix = pd->nprefix;
+	pd->nprefix = 0;
+	pd->linestart = 0;
+	for (int k = 0; k < nprefix; k++) pushhexchar(pd, pd->prefix[k]);
+}
+
+// Feed next piece of input. Returns number of CIVIC strings completed in it.
+
+int civicPushBytes (civic_push_decoder *pd, const char *data, int nlen) {
+	int ndone = 0;
+	if (pd->rawflag) {
+		for (int k = 0; k < nlen; k++) pushoctet(pd, (BYTE) data[k]);
+		return 0;
+	}
+	for (int k = 0; k < nlen; k++) {
+		int c = data[k];
+		if (pd->comment) {		// not a CIVIC string, so not counted
+			if (c == '\n') {
+				pd->comment = 0;
+				pd->linestart = 1;
+			}
+			continue;
+		}
+		if (c == '\n') {
+			if (pd->nprefix > 0) pushreplayprefix(pd);
+			civicPushEnd(pd);
+			ndone++;
+			continue;
+		}
+		if (pd->linestart) {
+			if (pd->nprefix == 0 && (c == ' ' || c == '\t' || c == '\r')) continue;
+			if (pd->nprefix == 0 && c == '#') {	// comment - ignore rest of line
+				pd->linestart = 0;
+				pd->comment = 1;
+				continue;
+			}
+			pd->prefix[pd->nprefix++] = (char) c;
+			if (!pushprefixpossible(pd)) pushreplayprefix(pd);
+			else if (c == '=') {	// prefix complete
+				pd->nprefix = 0;
+				pd->linestart = 0;
+			}
+			continue;
+		}
+		pushhexchar(pd, c);
+	}
+	return ndone;
+}
+
+// Decode CIVIC strings from stdin as they arrive (-stream), reading chunksize bytes at a time
+
+void showPushField (void *context, int subelement, int type, const char *value, int nlen) {
+	(void) context;
+	if (subelement == LOCATION_CIVIC && type == COUNTRY_FIELD) {
+		printf("\t\"%s\"\t(COUNTRY CODE)\n", value);
+		printf("Location Civic Keys and Values:\n");
+	}
+	else if (subelement == LOCATION_CIVIC) {
+		const char *key = CA_type_string(type);
+		printf("%3d\t\"%s\"\t(%s)\n", type, value, (key != NULL) ? key : "(null)");
+	}
+	else if (subelement == MAP_IMAGE_CIVIC) {
+		printf("Map URL: %s\n", value);
+		printf("Map Meme: %s\n", map_meme_type_string(type));
+	}
+	else if (subelement == LOCATION_REFERENCE_CIVIC) {
+		printf("Location Reference: %s\n", value);
+	}
+	else if (subelement == LOCATION_SHAPE_CIVIC) {
+		location_shape shape;
+		float xy[2 * MAX_POLYGON_POINTS];
+		decodeLocationShape((const BYTE *) value, nlen, &shape, xy, NULL);	// (already checked)
+		showLocationShape(&shape, NULL);
+	}
+	else if (traceflag) printf("subelement ID %d (%d bytes)\n", subelement, nlen);
+	fflush(stdout);
+}
+
+void showPushEnd (void *context, int nerr) {
+	int *nstrings = (int *) context;
+	(*nstrings)++;
+	if (debugflag) printf("End of CIVIC string %d (%d errors)\n", *nstrings, nerr);
+	printf("\n");
+	fflush(stdout);
+}
+
+int readstdin (char *buf, int nlen) {
+#ifdef _WIN32
+	return _read(0, buf, nlen);
+#else
+	return (int) read(0, buf, nlen);
+#endif
+}
+
+int decodeCivicStream (int rawflag, int chunksize) {
+	int nstrings = 0;
+	civic_push_decoder pd;
+	initCivicPushDecoder(&pd, rawflag, civicbudget, showPushField, showPushEnd, &nstrings, NULL);
+	if (chunksize <= 0) chunksize = 4096;
+	char *buf = (char *) malloc(chunksize);
+	if (buf == NULL) exit(1);
+	int nlen;
+	while ((nlen = readstdin(buf, chunksize)) > 0)
+		civicPushBytes(&pd, buf, nlen);
+	if (pd.nbyt > 0 || pd.nprefix > 0 || pd.nibble >= 0 || pd.nerr > 0) {	// last line without newline
+		if (pd.nprefix > 0) pushreplayprefix(&pd);
+		civicPushEnd(&pd);
+	}
+	free(buf);
+	return nstrings;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+// Decoding a (large) file of CIVIC strings, one per line, using all cores.
+// The file is memory mapped and split into newline-aligned chunks that are decoded in parallel.
+// Output of each chunk is collected in a text buffer, and printed in the original order.
+// At most window chunks can be decoded ahead of the one being printed, so memory use stays bounded.
+
+#define CHUNK_BYTES (1 << 20)	// (approximate) size of piece of input handed to a thread at a time
+
+// Map whole file into memory read-only (returns NULL on failure)
+
+const char *mapfile(const char *path, size_t *size) {
+	*size = 0;
+#ifdef _WIN32
+	HANDLE hfile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+							   FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hfile == INVALID_HANDLE_VALUE) return NULL;
+	LARGE_INTEGER fsize;
+	if (!GetFileSizeEx(hfile, &fsize)) {
+		CloseHandle(hfile);
+		return NULL;
+	}
+	if (fsize.QuadPart == 0) {	// can't map empty file
+		CloseHandle(hfile);
+		return "";
+	}
+	HANDLE hmap = CreateFileMappingA(hfile, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(hfile);
+	if (hmap == NULL) return NULL;
+	const char *text = (const char *) MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(hmap);	// view keeps mapping alive
+	if (text == NULL) return NULL;
+	*size = (size_t) fsize.QuadPart;
+	return text;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size == 0) {		// can't map empty file
+		close(fd);
+		return "";
+	}
+	void *text = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);	// mapping stays valid
+	if (text == MAP_FAILED) return NULL;
+	madvise(text, (size_t) st.st_size, MADV_SEQUENTIAL);
+	*size = (size_t) st.st_size;
+	return (const char *) text;
+#endif
+}
+
+void unmapfile(const char *text, size_t size) {
+	if (size == 0) return;
+#ifdef _WIN32
+	UnmapViewOfFile(text);
+#else
+	munmap((void *) text, size);
+#endif
+}
+
+typedef struct decode_job {
+	const char *text;		// memory mapped input file
+	size_t size;
+	size_t nchunks;
+	size_t window;			// size of reorder buffer (in chunks)
+	textbuf *output;		// reorder buffer: output of chunk k is in slot k % window
+	char *ready;			// flags: output of chunk in slot is complete
+	size_t nextchunk;		// next chunk to be handed to a thread
+	size_t nextwrite;		// next chunk to be printed
+	int nerr;				// total errors found
+	std::mutex lock;		// protects the above (except text, size, nchunks, window)
+	std::condition_variable changed;
+} decode_job;
+
+// Start of chunk k: first character after the newline at or after k * CHUNK_BYTES - 1
+
+size_t chunkstart (const decode_job *job, size_t k) {
+	if (k == 0) return 0;
+	if (k >= job->nchunks) return job->size;
+	size_t n = k * CHUNK_BYTES - 1;
+	const char *eol = (const char *) memchr(job->text + n, '\n', job->size - n);
+	return (eol == NULL) ? job->size : (size_t) (eol - job->text) + 1;
+}
+
+// Split line (not null terminated) into optional AP identifier and CIVIC string: [<AP-ID> ][-][civic=]<hex>
+// Accepts hostapd.conf style civic=... and command line style -civic=...
+// Returns 0 for blank lines and comments (#).
+
+int splitCivicLine (const char *line, int nlen, const char **apid, int *apidlen, const char **hex, int *hexlen) {
+	while (nlen > 0 && (*line == ' ' || *line == '\t')) { line++; nlen--; }
+	while (nlen > 0 && (line[nlen-1] == '\r' || line[nlen-1] == ' ' || line[nlen-1] == '\t')) nlen--;
+	if (nlen == 0 || *line == '#') return 0;
+	*apid = NULL;
+	*apidlen = 0;
+	int k = 0;
+	while (k < nlen && line[k] != ' ' && line[k] != '\t') k++;
+	if (k < nlen) {	// AP identifier, followed by white space
+		*apid = line;
+		*apidlen = k;
+		while (k < nlen && (line[k] == ' ' || line[k] == '\t')) k++;
+		line += k;
+		nlen -= k;
+	}
+	if (*line == '-') { line++; nlen--; }
+	if (nlen >= 6 && _strnicmp(line, "civic=", 6) == 0) { line += 6; nlen -= 6; }
+	*hex = line;
+	*hexlen = nlen;
+	return 1;
+}
+
+// Check CIVIC string of nlen hex characters (not null terminated), then decode it
+
+int decodeCivicHex (const char *hex, int nlen, civic_record *rec, textbuf *tb) {
+	for (int k = 0; k < nlen; k++) {
+		if (!ishexchar(hex[k])) {
+			outprintf(tb, "ERROR: non hexadecimal char %d at position %d\n", hex[k], k);
+			return 1;
+		}
+	}
+	if (nlen % 2 != 0) {
+		outprintf(tb, "ERROR: odd number of hexadecimal chars %d\n", nlen);
+		return 1;
+	}
+	return decodeCivicRecord(hex, nlen/2, civicbudget, rec, tb);
+}
+
+int decodeCivicLine (const char *line, int nlen, civic_record *rec, textbuf *tb) {
+	const char *apid, *hex;
+	int apidlen, hexlen;
+	if (!splitCivicLine(line, nlen, &apid, &apidlen, &hex, &hexlen)) return 0;
+	if (apid != NULL) outprintf(tb, "%.*s ", apidlen, apid);
+	outprintf(tb, "-civic=%.*s\n", hexlen, hex);
+	return decodeCivicHex(hex, hexlen, rec, tb);
+}
+
+int decodeChunk (decode_job *job, size_t k, civic_record *rec, textbuf *tb) {
+	int nerr = 0;
+	size_t start = chunkstart(job, k);
+	size_t end = chunkstart(job, k+1);
+	while (start < end) {
+		const char *line = job->text + start;
+		const char *eol = (const char *) memchr(line, '\n', end - start);
+		size_t nlen = (eol == NULL) ? end - start : (size_t) (eol - line);
+		nerr += decodeCivicLine(line, (int) nlen, rec, tb);
+		start += nlen + 1;
+	}
+	return nerr;
+}
+
+void decodeWorker (decode_job *job) {
+	civic_record rec;
+	initCivicRecord(&rec);
+	for (;;) {
+		size_t k;
+		{
+			std::unique_lock<std::mutex> guard(job->lock);
+			// don't get too far ahead of chunk being printed
+			while (job->nextchunk < job->nchunks && job->nextchunk >= job->nextwrite + job->window)
+				job->changed.wait(guard);
+			if (job->nextchunk >= job->nchunks) break;
+			k = job->nextchunk++;
+		}
+		textbuf tb = { NULL, 0, 0 };
+		int nerr = decodeChunk(job, k, &rec, &tb);
+		{
+			std::lock_guard<std::mutex> guard(job->lock);
+			job->output[k % job->window] = tb;
+			job->ready[k % job->window] = 1;
+			job->nerr += nerr;
+		}
+		job->changed.notify_all();
+	}
+	freeCivicRecord(&rec);
+}
+
+// Decode all lines in file, in parallel, printing results in order. Returns number of errors.
+
+int decodeCivicFile (const char *path, int nthreads) {
+	size_t size;
+	const char *text = mapfile(path, &size);
+	if (text == NULL) {
+		printf("ERROR: can't open/map file %s\n", path);
+		return 1;
+	}
+	if (nthreads <= 0) nthreads = (int) std::thread::hardware_concurrency();
+	if (nthreads <= 0) nthreads = 1;
+	decode_job *job = new decode_job;
+	job->text = text;
+	job->size = size;
+	job->nchunks = (size + CHUNK_BYTES - 1) / CHUNK_BYTES;
+	job->window = 2 * (size_t) nthreads;
+	job->output = (textbuf *) calloc(job->window, sizeof(textbuf));
+	job->ready = (char *) calloc(job->window, sizeof(char));
+	if (job->output == NULL || job->ready == NULL) exit(1);
+	job->nextchunk = 0;
+	job->nextwrite = 0;
+	job->nerr = 0;
+	if (traceflag) printf("file %s %zu bytes %zu chunks %d threads\n", path, size, job->nchunks, nthreads);
+
+	std::thread *workers = new std::thread[nthreads];
+	for (int i = 0; i < nthreads; i++)
+		workers[i] = std::thread(decodeWorker, job);
+
+	// print chunks in order as they become available
+	while (job->nextwrite < job->nchunks) {
+		textbuf tb;
+		{
+			std::unique_lock<std::mutex> guard(job->lock);
+			size_t slot = job->nextwrite % job->window;
+			while (!job->ready[slot]) job->changed.wait(guard);
+			tb = job->output[slot];
+			job->ready[slot] = 0;
+			job->nextwrite++;
+		}
+		job->changed.notify_all();
+		if (tb.nlen > 0) fwrite(tb.text, 1, tb.nlen, stdout);
+		free(tb.text);
+	}
+	fflush(stdout);
+
+	for (int i = 0; i < nthreads; i++) workers[i].join();
+	delete [] workers;
+	int nerr = job->nerr;
+	free(job->output);
+	free(job->ready);
+	delete job;
+	unmapfile(text, size);
+	if (verboseflag) fprintf(stderr, "%s: %zu bytes, %d errors\n", path, size, nerr);
+	return nerr;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+// Columnar (struct-of-arrays) binary file for a decoded corpus of CIVIC strings (-export=...).
+// Each CA type that occurs gets its own column of 32 bit offsets (one per record) into a shared
+// string heap, with NO_VALUE where the record does not have that CA type. Values of one column are
+// contiguous in the heap, so a column scan (e.g. all FLOOR values) reads memory sequentially.
+// There are also country code, map meme type, map URL and AP-ID columns.
+// The file is in native byte order and is used in place via mmap (-corpus=...) without any parsing.
+
+#define CORPUS_MAGIC "CIVICCOL"
+#define CORPUS_VERSION 1
+#define CORPUS_BYTEORDER 0x01020304
+#define CORPUS_ALIGN 64			// columns start on cache line boundary
+#define NO_VALUE 0xFFFFFFFFu	// heap offset for value not present in record
+
+typedef struct corpus_header {
+	char magic[8];				// CORPUS_MAGIC (not null terminated)
+	uint32_t version;
+	uint32_t byteorder;			// CORPUS_BYTEORDER, to detect file from machine of other endianness
+	uint32_t nrecords;
+	uint32_t reserved;
+	uint64_t filesize;
+	uint64_t heap;				// file offsets of sections...
+	uint64_t heapsize;
+	uint64_t country;			// 2 chars per record (zero if no LOCATION_CIVIC subelement)
+	uint64_t mapmeme;			// 1 byte per record
+	uint64_t mapurl;			// uint32 heap offset per record
+	uint64_t apid;				// uint32 heap offset per record
+	uint64_t CA[MAX_CA_TYPE+1];	// uint32 heap offset per record (0 if no record has this CA type)
+} corpus_header;
+
+// Building a corpus in memory, one column at a time
+
+typedef struct corpus_column {
+	textbuf offsets;	// uint32 per record (relative to start of strings, until written)
+	textbuf strings;	// null terminated values
+} corpus_column;
+
+typedef struct corpus_builder {
+	uint32_t nrecords;
+	corpus_column *CA[MAX_CA_TYPE+1];	// NULL until a record has this CA type
+	corpus_column mapurl;
+	corpus_column apid;
+	textbuf country;
+	textbuf mapmeme;
+} corpus_builder;
+
+// Add value (or NO_VALUE, if value is NULL) for record nrec, padding column for records skipped
+
+void addColumnValue (corpus_column *col, uint32_t nrec, const char *value, int nlen) {
+	uint32_t off = NO_VALUE;
+	while ((uint32_t) col->offsets.nlen / sizeof(uint32_t) < nrec)
+		appendbytes(&col->offsets, &off, sizeof(uint32_t));
+	if (value == NULL) return;
+	off = (uint32_t) col->strings.nlen;
+	appendbytes(&col->offsets, &off, sizeof(uint32_t));
+	appendbytes(&col->strings, value, nlen);
+	appendbytes(&col->strings, "", 1);	// null terminate
+}
+
+void addCorpusRecord (corpus_builder *cb, const civic_record *rec, const char *apid, int apidlen) {
+	uint32_t nrec = cb->nrecords;
+	for (int k = 0; k <= MAX_CA_TYPE; k++) {
+		if (rec->CA[k] == NULL) continue;
+		if (cb->CA[k] == NULL) {
+			cb->CA[k] = (corpus_column *) calloc(1, sizeof(corpus_column));
+			if (cb->CA[k] == NULL) exit(1);
+		}
+		addColumnValue(cb->CA[k], nrec, rec->CA[k], (int) strlen(rec->CA[k]));
+	}
+	if (rec->mapimagestring != NULL)
+		addColumnValue(&cb->mapurl, nrec, rec->mapimagestring, (int) strlen(rec->mapimagestring));
+	if (apid != NULL)
+		addColumnValue(&cb->apid, nrec, apid, apidlen);
+	appendbytes(&cb->country, rec->country_code, 2);
+	BYTE meme = (BYTE) rec->mapmemetype;
+	appendbytes(&cb->mapmeme, &meme, 1);
+	cb->nrecords++;
+}
+
+void freeCorpusColumn (corpus_column *col) {
+	free(col->offsets.text);
+	free(col->strings.text);
+}
+
+void freeCorpusBuilder (corpus_builder *cb) {
+	for (int k = 0; k <= MAX_CA_TYPE; k++) {
+		if (cb->CA[k] == NULL) continue;
+		freeCorpusColumn(cb->CA[k]);
+		free(cb->CA[k]);
+	}
+	freeCorpusColumn(&cb->mapurl);
+	freeCorpusColumn(&cb->apid);
+	free(cb->country.text);
+	free(cb->mapmeme.text);
+	memset(cb, 0, sizeof(corpus_builder));
+}
+
+uint64_t INLINE corpusalign (uint64_t offset) {
+	return (offset + CORPUS_ALIGN - 1) & ~(uint64_t) (CORPUS_ALIGN - 1);
+}
+
+// Write padding (zeros) until file position reaches offset
+
+void writepadding (FILE *fp, uint64_t *pos, uint64_t offset) {
+	static const char zeros[CORPUS_ALIGN] = { 0 };
+	while (*pos < offset) {
+		size_t n = (size_t) (offset - *pos);
+		if (n > sizeof(zeros)) n = sizeof(zeros);
+		*pos += fwrite(zeros, 1, n, fp);
+	}
+}
+
+// Write contents of text buffer (which may never have been allocated, e.g. no AP-IDs or no records)
+
+uint64_t writetext (FILE *fp, const textbuf *tb) {
+	if (tb->nlen == 0) return 0;
+	return fwrite(tb->text, 1, tb->nlen, fp);
+}
+
+// Place column of offsets in file (and its strings in heap), rebasing offsets to start of heap
+
+uint64_t placeColumn (corpus_column *col, uint32_t nrecords, uint64_t *offset, uint64_t *heapsize) {
+	addColumnValue(col, nrecords, NULL, 0);		// pad to full length
+	uint64_t place = *offset;
+	uint32_t *off = (uint32_t *) col->offsets.text;
+	for (uint32_t i = 0; i < nrecords; i++)
+		if (off[i] != NO_VALUE) off[i] += (uint32_t) *heapsize;
+	*offset = corpusalign(*offset + (uint64_t) nrecords * sizeof(uint32_t));
+	*heapsize += col->strings.nlen;
+	return place;
+}
+
+// Write corpus to file. Returns number of errors.
+
+int writeCivicCorpus (corpus_builder *cb, const char *path) {
+	uint32_t nrec = cb->nrecords;
+	corpus_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CORPUS_MAGIC, sizeof(header.magic));
+	header.version = CORPUS_VERSION;
+	header.byteorder = CORPUS_BYTEORDER;
+	header.nrecords = nrec;
+
+	// lay out sections (heap strings in the same order as the columns)
+	uint64_t offset = corpusalign(sizeof(corpus_header));
+	uint64_t heapsize = 0;
+	header.country = offset;
+	offset = corpusalign(offset + (uint64_t) nrec * 2);
+	header.mapmeme = offset;
+	offset = corpusalign(offset + nrec);
+	header.mapurl = placeColumn(&cb->mapurl, nrec, &offset, &heapsize);
+	header.apid = placeColumn(&cb->apid, nrec, &offset, &heapsize);
+	for (int k = 0; k <= MAX_CA_TYPE; k++)
+		if (cb->CA[k] != NULL) header.CA[k] = placeColumn(cb->CA[k], nrec, &offset, &heapsize);
+	if (heapsize >= NO_VALUE) {
+		printf("ERROR: string heap of %llu bytes too large for 32 bit offsets\n", (unsigned long long) heapsize);
+		return 1;
+	}
+	header.heap = offset;
+	header.heapsize = heapsize;
+	header.filesize = offset + heapsize;
+
+	FILE *fp = fopen(path, "wb");
+	if (fp == NULL) {
+		printf("ERROR: can't open %s for writing\n", path);
+		return 1;
+	}
+	uint64_t pos = fwrite(&header, 1, sizeof(header), fp);
+	writepadding(fp, &pos, header.country);
+	pos += writetext(fp, &cb->country);
+	writepadding(fp, &pos, header.mapmeme);
+	pos += writetext(fp, &cb->mapmeme);
+	writepadding(fp, &pos, header.mapurl);
+	pos += writetext(fp, &cb->mapurl.offsets);
+	writepadding(fp, &pos, header.apid);
+	pos += writetext(fp, &cb->apid.offsets);
+	for (int k = 0; k <= MAX_CA_TYPE; k++) {
+		if (cb->CA[k] == NULL) continue;
+		writepadding(fp, &pos, header.CA[k]);
+		pos += writetext(fp, &cb->CA[k]->offsets);
+	}
+	writepadding(fp, &pos, header.heap);
+	pos += writetext(fp, &cb->mapurl.strings);
+	pos += writetext(fp, &cb->apid.strings);
+	for (int k = 0; k <= MAX_CA_TYPE; k++)
+		if (cb->CA[k] != NULL) pos += writetext(fp, &cb->CA[k]->strings);
+	int nerr = 0;
+	if (fclose(fp) != 0 || pos != header.filesize) {
+		printf("ERROR: failed writing %s (%llu of %llu bytes)\n", path,
+			   (unsigned long long) pos, (unsigned long long) header.filesize);
+		nerr++;
+	}
+	return nerr;
+}
+
+// Decode all lines in file of CIVIC strings and write them to corpus file. Returns number of errors.
+// Lines with errors are reported (and left out of the corpus).
+
+int exportCivicCorpus (const char *inpath, const char *outpath) {
+	size_t size;
+	const char *text = mapfile(inpath, &size);
+	if (text == NULL) {
+		printf("ERROR: can't open/map file %s\n", inpath);
+		return 1;
+	}
+	corpus_builder cb;
+	memset(&cb, 0, sizeof(cb));
+	civic_record rec;
+	initCivicRecord(&rec);
+	textbuf tb = { NULL, 0, 0 };	// decoding output (only shown if there is an error)
+	int nerr = 0;
+	int nline = 0;
+	size_t start = 0;
+	while (start < size) {
+		const char *line = text + start;
+		const char *eol = (const char *) memchr(line, '\n', size - start);
+		size_t nlen = (eol == NULL) ? size - start : (size_t) (eol - line);
+		const char *apid, *hex;
+		int apidlen, hexlen;
+		start += nlen + 1;
+		nline++;
+		if (!splitCivicLine(line, (int) nlen, &apid, &apidlen, &hex, &hexlen)) continue;
+		tb.nlen = 0;
+		if (decodeCivicHex(hex, hexlen, &rec, &tb) > 0) {
+			printf("ERROR: line %d not exported: -civic=%.*s\n%.*s", nline, hexlen, hex, tb.nlen, tb.text);
+			nerr++;
+			continue;
+		}
+		addCorpusRecord(&cb, &rec, apid, apidlen);
+	}
+	free(tb.text);
+	freeCivicRecord(&rec);
+	unmapfile(text, size);
+	nerr += writeCivicCorpus(&cb, outpath);
+	if (verboseflag) fprintf(stderr, "%s: %u records, %d errors\n", outpath, cb.nrecords, nerr);
+	freeCorpusBuilder(&cb);
+	return nerr;
+}
+
+// Corpus file mapped into memory
+
+typedef struct civic_corpus {
+	const char *base;
+	size_t size;
+	const corpus_header *header;
+} civic_corpus;
+
+int INLINE corpusSectionOK (const civic_corpus *corpus, uint64_t offset, uint64_t nbytes) {
+	return offset % CORPUS_ALIGN == 0 && offset <= corpus->size && nbytes <= corpus->size - offset;
+}
+
+// Map corpus file and check header (constant time - no scan over records). Returns 0 on success.
+
+int openCivicCorpus (const char *path, civic_corpus *corpus) {
+	corpus->base = mapfile(path, &corpus->size);
+	corpus->header = NULL;
+	if (corpus->base == NULL) {
+		printf("ERROR: can't open/map file %s\n", path);
+		return -1;
+	}
+	const corpus_header *h = (const corpus_header *) corpus->base;
+	uint64_t n = (corpus->size >= sizeof(corpus_header)) ? h->nrecords : 0;
+	int ok = corpus->size >= sizeof(corpus_header) &&
+		memcmp(h->magic, CORPUS_MAGIC, sizeof(h->magic)) == 0 &&
+		h->version == CORPUS_VERSION && h->byteorder == CORPUS_BYTEORDER &&
+		h->filesize == corpus->size &&
+		corpusSectionOK(corpus, h->heap, h->heapsize) &&
+		(h->heapsize == 0 || corpus->base[h->heap + h->heapsize - 1] == '\0') &&
+		corpusSectionOK(corpus, h->country, n * 2) &&
+		corpusSectionOK(corpus, h->mapmeme, n) &&
+		corpusSectionOK(corpus, h->mapurl, n * sizeof(uint32_t)) &&
+		corpusSectionOK(corpus, h->apid, n * sizeof(uint32_t));
+	for (int k = 0; ok && k <= MAX_CA_TYPE; k++)
+		if (h->CA[k] != 0) ok = corpusSectionOK(corpus, h->CA[k], n * sizeof(uint32_t));
+	if (!ok) {
+		printf("ERROR: %s is not a (compatible) corpus file\n", path);
+		unmapfile(corpus->base, corpus->size);
+		corpus->base = NULL;
+		return -1;
+	}
+	corpus->header = h;
+	return 0;
+}
+
+void closeCivicCorpus (civic_corpus *corpus) {
+	if (corpus->base != NULL) unmapfile(corpus->base, corpus->size);
+	corpus->base = NULL;
+	corpus->header = NULL;
+}
+
+// Column of heap offsets (NULL if no record has this value)
+
+const uint32_t *corpusColumn (const civic_corpus *corpus, uint64_t offset) {
+	if (offset == 0) return NULL;
+	return (const uint32_t *) (corpus->base + offset);
+}
+
+// Value for record i of column (NULL if not present)
+
+const char *corpusString (const civic_corpus *corpus, const uint32_t *column, uint32_t i) {
+	if (column == NULL || column[i] >= corpus->header->heapsize) return NULL;	// includes NO_VALUE
+	return corpus->base + corpus->header->heap + column[i];
+}
+
+// Load corpus file and show summary, or list one CA column (with AP-IDs)
+
+int showCivicCorpus (const char *path, int column) {
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	civic_corpus corpus;
+	if (openCivicCorpus(path, &corpus) < 0) return 1;
+	std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+	const corpus_header *h = corpus.header;
+	const uint32_t *apid = corpusColumn(&corpus, h->apid);
+	if (column >= 0) {
+		const uint32_t *values = corpusColumn(&corpus, h->CA[column]);
+		if (values != NULL) {
+			for (uint32_t i = 0; i < h->nrecords; i++) {
+				const char *value = corpusString(&corpus, values, i);
+				if (value == NULL) continue;
+				const char *id = corpusString(&corpus, apid, i);
+				printf("%s\t\"%s\"\n", (id != NULL) ? id : "", value);
+			}
+		}
+	}
+	else {
+		printf("%u records (%llu bytes heap)\n", h->nrecords, (unsigned long long) h->heapsize);
+		for (int k = 0; k <= MAX_CA_TYPE; k++) {
+			const uint32_t *values = corpusColumn(&corpus, h->CA[k]);
+			if (values == NULL) continue;
+			uint32_t count = 0;
+			for (uint32_t i = 0; i < h->nrecords; i++)
+				if (values[i] != NO_VALUE) count++;
+			const char *key = CA_type_string(k);
+			printf("%3d\t%u values\t(%s)\n", k, count, (key != NULL) ? key : "(null)");
+		}
+		const uint32_t *mapurl = corpusColumn(&corpus, h->mapurl);
+		uint32_t count = 0;
+		for (uint32_t i = 0; i < h->nrecords; i++)
+			if (mapurl[i] != NO_VALUE) count++;
+		printf("Map URL: %u values\n", count);
+	}
+	std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
+	if (verboseflag)
+		fprintf(stderr, "%s: open %.3f msec, scan %.3f msec\n", path,
+				std::chrono::duration<double, std::milli>(t1 - t0).count(),
+				std::chrono::duration<double, std::milli>(t2 - t1).count());
+	closeCivicCorpus(&corpus);
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+// Watching a directory of hostapd.conf files (-watch=...), checking civic=... and lci=... lines as they change.
+// For each file we keep a hash of the value of each civic=/lci= line, and the decoded record.
+// When a file changes, only lines whose hash is new are decoded, and only differences are reported:
+// ADDED and CHANGED (with results of decoding / checking) and REMOVED.
+
+typedef struct watch_entry {
+	int kind;			// LOCATION_CIVIC_TYPE (civic=...) or LCI_TYPE (lci=...)
+	int index;			// occurrence of this key in file (0, 1, ...)
+	int line;			// line number in file
+	uint64_t hash;		// of value
+	int nerr;			// errors found decoding value
+	civic_record rec;	// decoded value (civic= only)
+	int matched;		// (scratch) entry carried over from previous version of file
+} watch_entry;
+
+typedef struct watch_file {
+	char *name;
+	int nentries;
+	watch_entry *entries;
+	int seen;			// (scratch) file still there when rescanning directory
+} watch_file;
+
+uint64_t hashbytes(const char *str, int nlen) {	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (int k = 0; k < nlen; k++) {
+		hash ^= (BYTE) str[k];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+const char *watch_key(int kind) {
+	return (kind == LCI_TYPE) ? "lci" : "civic";
+}
+
+// Check framing of LCI string (Measurement Report header, then subelements that fit)
+
+int checkLCIHex (const char *hex, int nlen, textbuf *tb) {
+	for (int k = 0; k < nlen; k++) {
+		if (!ishexchar(hex[k])) {
+			outprintf(tb, "ERROR: non hexadecimal char %d at position %d\n", hex[k], k);
+			return 1;
+		}
+	}
+	if (nlen % 2 != 0) {
+		outprintf(tb, "ERROR: odd number of hexadecimal chars %d\n", nlen);
+		return 1;
+	}
+	int slen = nlen / 2;
+	if (slen < 3) {
+		outprintf(tb, "ERROR: LCI string too short (%d bytes)\n", slen);
+		return 1;
+	}
+	int nerr = 0;
+	int a = getoctet(hex, 0), b = getoctet(hex, 1), c = getoctet(hex, 2);
+	if (a != MEASURE_TOKEN || b != MEASURE_REQUEST_MODE || c != LCI_TYPE) {
+		outprintf(tb, "ERROR: Bad Measurement Element Type %02X %02X %02X\n", a, b, c);
+		nerr++;
+	}
+	int nbyt = 3;
+	while (nbyt + 2 <= slen) {
+		int ID = getoctet(hex, nbyt++);
+		int olen = getoctet(hex, nbyt++);
+		if (nbyt + olen > slen) {
+			outprintf(tb, "ERROR: bad length code ID %d (0x%02X) nlen %d (0x%02X) at nbyt %d slen %d\n",
+				   ID, ID, olen, olen, nbyt-1, slen);
+			return nerr + 1;
+		}
+		if (traceflag) outprintf(tb, "LCI subelement ID %d nlen %d\n", ID, olen);
+		nbyt += olen;
+	}
+	if (nbyt < slen) {
+		outprintf(tb, "ERROR: %d byte(s) left over at nbyt %d slen %d\n", slen - nbyt, nbyt, slen);
+		nerr++;
+	}
+	return nerr;
+}
+
+// Read whole file (rather than mapping it, since it may be rewritten while we look at it)
+
+char *readfile(const char *path, int *size) {
+	*size = 0;
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) return NULL;
+	textbuf tb = { NULL, 0, 0 };
+	char buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		appendbytes(&tb, buf, (int) n);
+	fclose(fp);
+	appendbytes(&tb, "", 1);	// so that even an empty file gives non-NULL result
+	*size = tb.nlen - 1;
+	return tb.text;
+}
+
+void freeWatchEntries (watch_entry *entries, int nentries) {
+	for (int i = 0; i < nentries; i++) freeCivicRecord(&entries[i].rec);
+	free(entries);
+}
+
+void showWatchDelta (const char *what, const char *name, const watch_entry *entry, const char *value, int nlen, textbuf *tb) {
+	printf("%s:%d\t%s\t%s=%.*s", name, entry->line, what, watch_key(entry->kind), nlen, value);
+	if (entry->nerr > 0) printf("\t(%d errors)\n", entry->nerr);
+	else printf("\t(OK)\n");
+	if (tb != NULL && (verboseflag || entry->nerr > 0) && tb->nlen > 0)
+		fwrite(tb->text, 1, tb->nlen, stdout);
+}
+
+// Re-read file and report differences from its previous version (wf->entries).
+// Returns number of lines that had to be decoded.
+
+int refreshWatchFile (const char *dir, watch_file *wf) {
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%s", dir, wf->name);
+	int size;
+	char *text = readfile(path, &size);
+	if (text == NULL) size = 0;		// treat missing file as empty
+	for (int i = 0; i < wf->nentries; i++) wf->entries[i].matched = 0;
+	int nentries = 0, alloc = 0;
+	watch_entry *entries = NULL;
+	int ndecoded = 0;
+	int counts[2] = { 0, 0 };	// occurrences of civic=, lci= so far
+	int nline = 0;
+	textbuf tb = { NULL, 0, 0 };
+	int start = 0;
+	while (start < size) {
+		const char *line = text + start;
+		const char *eol = (const char *) memchr(line, '\n', size - start);
+		int nlen = (eol == NULL) ? size - start : (int) (eol - line);
+		start += nlen + 1;
+		nline++;
+		while (nlen > 0 && (*line == ' ' || *line == '\t')) { line++; nlen--; }
+		while (nlen > 0 && (line[nlen-1] == '\r' || line[nlen-1] == ' ' || line[nlen-1] == '\t')) nlen--;
+		int kind;
+		if (nlen >= 6 && strncmp(line, "civic=", 6) == 0) { kind = LOCATION_CIVIC_TYPE; line += 6; nlen -= 6; }
+		else if (nlen >= 4 && strncmp(line, "lci=", 4) == 0) { kind = LCI_TYPE; line += 4; nlen -= 4; }
+		else continue;
+		if (nentries == alloc) {
+			alloc = (alloc == 0) ? 8 : alloc * 2;
+			entries = (watch_entry *) realloc(entries, alloc * sizeof(watch_entry));
+			if (entries == NULL) exit(1);
+		}
+		watch_entry *entry = &entries[nentries++];
+		memset(entry, 0, sizeof(watch_entry));
+		entry->kind = kind;
+		entry->index = counts[kind == LCI_TYPE]++;
+		entry->line = nline;
+		entry->hash = hashbytes(line, nlen);
+		// same value as before (preferably at same position in file) ? then no need to decode again
+		watch_entry *old = NULL;
+		watch_entry *previous = NULL;	// entry for same key at same position (whether or not value changed)
+		for (int i = 0; i < wf->nentries; i++) {
+			watch_entry *e = &wf->entries[i];
+			if (e->matched || e->kind != kind) continue;
+			if (e->index == entry->index) {
+				previous = e;
+				if (e->hash == entry->hash) { old = e; break; }
+			}
+			else if (old == NULL && e->hash == entry->hash) old = e;
+		}
+		if (old != NULL) {
+			old->matched = 1;
+			entry->nerr = old->nerr;
+			entry->rec = old->rec;		// take over decoded record
+			initCivicRecord(&old->rec);
+			continue;
+		}
+		tb.nlen = 0;
+		if (nlen == 0) entry->nerr = 0;		// lci= or civic= with no value - i.e. not set
+		else if (kind == LCI_TYPE) entry->nerr = checkLCIHex(line, nlen, &tb);
+		else entry->nerr = decodeCivicHex(line, nlen, &entry->rec, &tb);
+		ndecoded++;
+		if (previous != NULL) previous->matched = 1;
+		showWatchDelta((previous != NULL) ? "CHANGED" : "ADDED", wf->name, entry, line, nlen, &tb);
+	}
+	for (int i = 0; i < wf->nentries; i++) {
+		if (wf->entries[i].matched) continue;
+		printf("%s:%d\tREMOVED\t%s=\n", wf->name, wf->entries[i].line, watch_key(wf->entries[i].kind));
+	}
+	free(tb.text);
+	free(text);
+	freeWatchEntries(wf->entries, wf->nentries);
+	wf->entries = entries;
+	wf->nentries = nentries;
+	return ndecoded;
+}
+
+#ifdef __linux__
+
+watch_file *findWatchFile (watch_file **files, int *nfiles, const char *name, int create) {
+	for (int i = 0; i < *nfiles; i++)
+		if (strcmp((*files)[i].name, name) == 0) return &(*files)[i];
+	if (!create) return NULL;
+	*files = (watch_file *) realloc(*files, (*nfiles + 1) * sizeof(watch_file));
+	if (*files == NULL) exit(1);
+	watch_file *wf = &(*files)[(*nfiles)++];
+	wf->name = (char *) strndup(name, strlen(name));
+	wf->nentries = 0;
+	wf->entries = NULL;
+	wf->seen = 0;
+	return wf;
+}
+
+void dropWatchFile (watch_file *files, int *nfiles, watch_file *wf) {
+	for (int i = 0; i < wf->nentries; i++)
+		printf("%s:%d\tREMOVED\t%s=\n", wf->name, wf->entries[i].line, watch_key(wf->entries[i].kind));
+	freeWatchEntries(wf->entries, wf->nentries);
+	free(wf->name);
+	*wf = files[--(*nfiles)];
+}
+
+// Config management typically writes a temporary file (hostapd.conf.tmp, .hostapd.conf.swp, tmp ...)
+// and then renames it. Only files matching -match=... are checked, so the temporary ones don't show up.
+
+int INLINE watchedname (const char *name) {
+	return name[0] != '.' && fnmatch(watchpattern, name, 0) == 0;
+}
+
+// (Re)check every watched file in directory, dropping those no longer there. Returns -1 if can't read directory.
+
+int scanWatchDirectory (const char *dir, watch_file **files, int *nfiles) {
+	DIR *dp = opendir(dir);
+	if (dp == NULL) {
+		printf("ERROR: can't read directory %s\n", dir);
+		return -1;
+	}
+	for (int i = 0; i < *nfiles; i++) (*files)[i].seen = 0;
+	struct dirent *de;
+	while ((de = readdir(dp)) != NULL) {
+		if (!watchedname(de->d_name)) continue;
+		if (de->d_type != DT_REG && de->d_type != DT_UNKNOWN) continue;
+		watch_file *wf = findWatchFile(files, nfiles, de->d_name, 1);
+		refreshWatchFile(dir, wf);
+		wf->seen = 1;
+	}
+	closedir(dp);
+	for (int i = *nfiles - 1; i >= 0; i--)
+		if (!(*files)[i].seen) dropWatchFile(*files, nfiles, &(*files)[i]);
+	return *nfiles;
+}
+
+// Check all files in directory, then report changes as they happen (does not return unless there is an error)
+
+int watchCivicDirectory (const char *dir) {
+	int fd = inotify_init();
+	if (fd < 0) {
+		printf("ERROR: can't initialize inotify\n");
+		return 1;
+	}
+	// config management typically writes a new file and renames it, so watch for renames too
+	if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE |
+						  IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+		printf("ERROR: can't watch directory %s\n", dir);
+		close(fd);
+		return 1;
+	}
+	watch_file *files = NULL;
+	int nfiles = 0;
+	if (scanWatchDirectory(dir, &files, &nfiles) < 0) {
+		close(fd);
+		return 1;
+	}
+	if (verboseflag) printf("Watching %d files matching %s in %s\n", nfiles, watchpattern, dir);
+	fflush(stdout);
+
+	char buf[16 * (sizeof(struct inotify_event) + 256)]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	int gone = 0;
+	while (!gone) {
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if (n <= 0) {
+			printf("ERROR: reading inotify events\n");
+			break;
+		}
+		for (char *p = buf; p < buf + n; ) {
+			const struct inotify_event *ev = (const struct inotify_event *) p;
+			p += sizeof(struct inotify_event) + ev->len;
+			if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+				printf("ERROR: directory %s deleted or moved, no longer watching it\n", dir);
+				gone = 1;
+				break;
+			}
+			if (ev->mask & IN_Q_OVERFLOW) {		// events lost, so we can't trust what we have
+				printf("WARNING: inotify events lost, checking all files in %s again\n", dir);
+				if (scanWatchDirectory(dir, &files, &nfiles) < 0) {
+					gone = 1;
+					break;
+				}
+				continue;
+			}
+			if (ev->len == 0 || !watchedname(ev->name)) continue;
+			if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+				watch_file *wf = findWatchFile(&files, &nfiles, ev->name, 0);
+				if (wf != NULL) dropWatchFile(files, &nfiles, wf);
+			}
+			else {
+				watch_file *wf = findWatchFile(&files, &nfiles, ev->name, 1);
+				int ndecoded = refreshWatchFile(dir, wf);
+				if (debugflag) printf("%s: %d entries, %d decoded\n", wf->name, wf->nentries, ndecoded);
+			}
+		}
+		fflush(stdout);
+	}
+	while (nfiles > 0) {
+		freeWatchEntries(files[0].entries, files[0].nentries);
+		free(files[0].name);
+		files[0] = files[--nfiles];
+	}
+	free(files);
+	close(fd);
+	return 1;
+}
+
+#else
+
+int watchCivicDirectory (const char *dir) {
+	printf("ERROR: -watch=%s needs inotify (Linux only)\n", dir);
+	return 1;
+}
+
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+// Self test (-test=N) run on all cores (-threads=...). For each of N records (edge cases, then random ones):
+// (i)   encode as hex and raw, check sizeCivicRecord() is exact, and that hex output read back using getoctet()
+//       is the raw output (there is no separate fast path for either yet, they share putbyte()),
+// (ii)  decode(encode(x)) == x, bit for bit, using the batch decoder on hex, and the push decoder on pieces
+//       of random size of raw octets, and of hex text (with civic= prefix, comments, whitespace, upper case),
+// (iii) mutate or truncate the encoding, and check batch and push decoders agree (on errors, and on fields),
+//       sometimes with a -budget=... limit smaller than the string,
+// (iv)  every BULK_TEST_EVERY cases, bulk encode up to BULK_SHAPES shapes with encodeLocationShapes() and decode them.
+// Also runs the hostapd examples (civic1 must decode, civic1a and civic2 must not), and the UTF8 round trip for all code points.
+// Each record is generated from its case number, so a failure can be reproduced.
+// Some records have many polygons (room outlines), so they are longer than 4096 octets.
+
+#define TEST_BATCH 1024		// cases handed to a thread at a time
+#define MAX_TEST_FAILURES 20	// failures shown in detail
+#define BULK_SHAPES 64			// most shapes in one bulk encoding test
+#define BULK_TEST_EVERY 16
+#define MAX_TEST_SHAPES 40		// most shapes in one generated record
+#define TEST_BYTES 12288		// enough for any generated record (MAX_TEST_SHAPES polygons and all the rest)
+#define TEST_BUDGET 4096		// -budget=... often tried on long records
+
+typedef struct test_job {
+	long long ncases;
+	std::atomic<long long> nextcase;
+	std::atomic<long long> nfail;
+	std::mutex lock;		// for printing failures
+} test_job;
+
+uint64_t INLINE splitmix64 (uint64_t *state) {
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+int INLINE randint (uint64_t *state, int n) {	// 0 ... n-1
+	return (int) (splitmix64(state) % (uint64_t) n);
+}
+
+// Storage for a generated record (values are never allowed to contain null)
+
+typedef struct test_record {
+	civic_record rec;
+	char text[4096];
+	location_shape shapes[MAX_TEST_SHAPES];
+	float xy[MAX_TEST_SHAPES][2 * MAX_POLYGON_POINTS];
+	char raw[TEST_BYTES], hex[2 * TEST_BYTES];		// encodings of record
+	char mut[TEST_BYTES], muthex[2 * TEST_BYTES];	// mutated encodings
+	location_shape bulk[BULK_SHAPES];	// for bulk encoding of shapes
+	float bulkxy[BULK_SHAPES][2 * MAX_POLYGON_POINTS];
+	char bulkraw[BULK_SHAPES * 256];
+	char bulkhex[2 * BULK_SHAPES * 256];
+} test_record;
+
+char *randomtext (test_record *tr, int *used, uint64_t *state, int nlen) {
+	char *text = tr->text + *used;
+	for (int k = 0; k < nlen; k++) text[k] = (char) (1 + randint(state, 255));	// no null
+	text[nlen] = '\0';
+	*used += nlen + 1;
+	return text;
+}
+
+void randomshape (location_shape *shape, float *xy, uint64_t *state) {
+	static const int types[] = { POINT_2D_SHAPE, POINT_3D_SHAPE, CIRCLE_SHAPE, SPHERE_SHAPE, POLYGON_SHAPE, ELLIPSE_SHAPE };
+	memset(shape, 0, sizeof(location_shape));
+	shape->type = types[randint(state, 6)];
+	shape->npoints = (shape->type == POLYGON_SHAPE) ? 3 + randint(state, MAX_POLYGON_POINTS - 2) : 1;
+	for (int k = 0; k < 2 * shape->npoints; k++) {	// any bit pattern (including NaN), must come back exactly
+		uint32_t u = (uint32_t) splitmix64(state);
+		memcpy(&xy[k], &u, sizeof(float));
+	}
+	shape->xy = xy;
+	uint32_t u[3] = { (uint32_t) splitmix64(state), (uint32_t) splitmix64(state), (uint32_t) splitmix64(state) };
+	if (shape->type == POINT_3D_SHAPE || shape->type == SPHERE_SHAPE) memcpy(&shape->z, &u[0], sizeof(float));
+	if (shape->type == CIRCLE_SHAPE || shape->type == SPHERE_SHAPE) memcpy(&shape->radius, &u[1], sizeof(float));
+	if (shape->type == ELLIPSE_SHAPE) {
+		shape->angle = randint(state, 0x10000);
+		memcpy(&shape->semimajor, &u[1], sizeof(float));
+		memcpy(&shape->semiminor, &u[2], sizeof(float));
+	}
+}
+
+void randompolygon (location_shape *shape, float *xy, int npoints, uint64_t *state) {
+	memset(shape, 0, sizeof(location_shape));
+	shape->type = POLYGON_SHAPE;
+	shape->npoints = npoints;
+	for (int k = 0; k < 2 * npoints; k++) {
+		uint32_t u = (uint32_t) splitmix64(state);
+		memcpy(&xy[k], &u, sizeof(float));
+	}
+	shape->xy = xy;
+}
+
+// Record for case number n: first all CA types with longest possible value, then all map meme types
+// with longest possible URL, then random records (one in 64 with many polygons).
+
+void generateTestRecord (test_record *tr, long long n, uint64_t *state) {
+	civic_record *rec = &tr->rec;
+	int used = 0;
+	initCivicRecord(rec);
+	rec->shapes = tr->shapes;
+	if (n <= MAX_CA_TYPE) {
+		memcpy(rec->country_code, "US", 2);
+		rec->CA[n] = randomtext(tr, &used, state, MAX_FIELD_LENGTH - 4);	// subelement also has country code
+		return;
+	}
+	if (n <= 2 * MAX_CA_TYPE + 1) {
+		rec->mapmemetype = (int) (n - MAX_CA_TYPE - 1);
+		rec->mapimagestring = randomtext(tr, &used, state, MAX_FIELD_LENGTH - 1);	// subelement also has meme type
+		return;
+	}
+	int ncase = randint(state, 4);	// 0: no LOCATION_CIVIC, 1: only country code, 2, 3: CA values
+	if (ncase > 0) {
+		rec->country_code[0] = (char) ('A' + randint(state, 26));
+		rec->country_code[1] = (char) ('A' + randint(state, 26));
+	}
+	int clen = 2;
+	int nCA = (ncase >= 2) ? 1 + randint(state, 8) : 0;
+	for (int i = 0; i < nCA; i++) {
+		int k = randint(state, MAX_CA_TYPE + 1);
+		int room = MAX_FIELD_LENGTH - clen - 2;
+		if (rec->CA[k] != NULL || room < 0) continue;
+		int nlen = randint(state, (room < 40 ? room : 40) + 1);
+		rec->CA[k] = randomtext(tr, &used, state, nlen);
+		clen += nlen + 2;
+	}
+	if (randint(state, 2)) {
+		rec->mapmemetype = randint(state, 256);
+		rec->mapimagestring = randomtext(tr, &used, state, randint(state, MAX_FIELD_LENGTH));	// (+ meme type)
+	}
+	if (randint(state, 4) == 0)
+		rec->locationreference = randomtext(tr, &used, state, randint(state, 40));
+	if (randint(state, 64) == 0) {	// floor plan: more than TEST_BUDGET octets
+		rec->nshapes = 24 + randint(state, MAX_TEST_SHAPES - 23);
+		for (int i = 0; i < rec->nshapes; i++)
+			randompolygon(&tr->shapes[i], tr->xy[i], 24 + randint(state, MAX_POLYGON_POINTS - 23), state);
+	}
+	else if (randint(state, 3) == 0) {
+		rec->nshapes = 1 + randint(state, 4);
+		for (int i = 0; i < rec->nshapes; i++) randomshape(&tr->shapes[i], tr->xy[i], state);
+	}
+}
+
+// Compare records bit for bit. Returns number of differences (described in tb).
+
+int INLINE samestring (const char *a, const char *b) {
+	return (a == NULL) ? (b == NULL) : (b != NULL && strcmp(a, b) == 0);
+}
+
+int sameshape (const location_shape *sa, const location_shape *sb) {
+	return sa->type == sb->type && sa->npoints == sb->npoints && sa->angle == sb->angle &&
+		memcmp(sa->xy, sb->xy, 2 * sa->npoints * sizeof(float)) == 0 &&
+		memcmp(&sa->z, &sb->z, sizeof(float)) == 0 && memcmp(&sa->radius, &sb->radius, sizeof(float)) == 0 &&
+		memcmp(&sa->semimajor, &sb->semimajor, sizeof(float)) == 0 &&
+		memcmp(&sa->semiminor, &sb->semiminor, sizeof(float)) == 0;
+}
+
+int compareCivicRecords (const civic_record *a, const civic_record *b, textbuf *tb) {
+	int ndiff = 0;
+	if (memcmp(a->country_code, b->country_code, 2) != 0) {
+		outprintf(tb, "country code %.2s != %.2s\n", a->country_code, b->country_code);
+		ndiff++;
+	}
+	for (int k = 0; k <= MAX_CA_TYPE; k++) {
+		if (samestring(a->CA[k], b->CA[k])) continue;
+		outprintf(tb, "CA type %d differs\n", k);
+		ndiff++;
+	}
+	if (!samestring(a->mapimagestring, b->mapimagestring) ||
+		(a->mapimagestring != NULL && a->mapmemetype != b->mapmemetype)) {
+		outprintf(tb, "map URL or meme type differs\n");
+		ndiff++;
+	}
+	if (!samestring(a->locationreference, b->locationreference)) {
+		outprintf(tb, "location reference differs\n");
+		ndiff++;
+	}
+	if (a->nshapes != b->nshapes) {
+		outprintf(tb, "%d shapes != %d shapes\n", a->nshapes, b->nshapes);
+		return ndiff + 1;
+	}
+	for (int i = 0; i < a->nshapes; i++) {
+		if (sameshape(&a->shapes[i], &b->shapes[i])) continue;
+		outprintf(tb, "shape %d differs\n", i);
+		ndiff++;
+	}
+	return ndiff;
+}
+
+// Bulk encoding of many shapes (mostly polygons) into one buffer: size must be exact, a buffer one byte
+// short must be refused, and each LOCATION_SHAPE subelement must decode back to its shape.
+// Returns number of errors (described in tb).
+
+int testBulkShapes (test_record *tr, uint64_t *state, textbuf *tb) {
+	int nshapes = 1 + randint(state, BULK_SHAPES);
+	for (int i = 0; i < nshapes; i++) {
+		do randomshape(&tr->bulk[i], tr->bulkxy[i], state);
+		while (tr->bulk[i].type != POLYGON_SHAPE && randint(state, 4) > 0);
+	}
+	int slen = sizeLocationShapes(tr->bulk, nshapes, 1, tb);
+	if (slen < 0 || sizeLocationShapes(tr->bulk, nshapes, 0, tb) != 2 * slen ||
+		encodeLocationShapes(tr->bulk, nshapes, 1, tr->bulkraw, slen, tb) != slen ||
+		encodeLocationShapes(tr->bulk, nshapes, 0, tr->bulkhex, 2 * slen, tb) != 2 * slen) {
+		outprintf(tb, "bulk encoding of %d shapes: size %d\n", nshapes, slen);
+		return 1;
+	}
+	if (encodeLocationShapes(tr->bulk, nshapes, 1, tr->bulkraw, slen - 1, tb) >= 0) {
+		outprintf(tb, "bulk encoding of %d shapes accepted buffer of %d bytes for %d\n", nshapes, slen - 1, slen);
+		return 1;
+	}
+	tb->nlen = 0;	// (error for buffer too small is expected)
+	const BYTE *raw = (const BYTE *) tr->bulkraw;
+	int nbyt = 0;
+	for (int i = 0; i < nshapes; i++) {
+		location_shape shape;
+		float xy[2 * MAX_POLYGON_POINTS];
+		if (nbyt + 2 > slen || raw[nbyt] != LOCATION_SHAPE_CIVIC || nbyt + 2 + raw[nbyt+1] > slen ||
+			decodeLocationShape(raw + nbyt + 2, raw[nbyt+1], &shape, xy, tb) > 0 || !sameshape(&shape, &tr->bulk[i])) {
+			outprintf(tb, "bulk encoding of %d shapes: shape %d does not decode at nbyt %d\n", nshapes, i, nbyt);
+			return 1;
+		}
+		nbyt += 2 + raw[nbyt+1];
+	}
+	for (int k = 0; k < slen; k++) {
+		if (getoctet(tr->bulkhex, k) == raw[k]) continue;
+		outprintf(tb, "bulk encoding of %d shapes: hex differs from raw at nbyt %d\n", nshapes, k);
+		return 1;
+	}
+	if (nbyt != slen) {
+		outprintf(tb, "bulk encoding of %d shapes: %d bytes left over\n", nshapes, slen - nbyt);
+		return 1;
+	}
+	return 0;
+}
+
+// Collect fields from push decoder into a record (the way decodeCivicRecord() would)
+
+typedef struct push_collector {
+	civic_record rec;
+	int nerr;		// errors reported at end of CIVIC string
+	int ended;		// number of CIVIC strings ended
+	char text[4 * TEST_BYTES + 256];	// hex input, with prefix, comments and whitespace
+} push_collector;
+
+char *collectstring (civic_record *rec, const char *value, int nlen) {
+	char *text = rec->heap + rec->heapused;
+	memcpy(text, value, nlen);
+	text[nlen] = '\0';
+	rec->heapused += nlen + 1;
+	return text;
+}
+
+void collectPushField (void *context, int subelement, int type, const char *value, int nlen) {
+	push_collector *pc = (push_collector *) context;
+	civic_record *rec = &pc->rec;
+	if (subelement == LOCATION_CIVIC && type == COUNTRY_FIELD) memcpy(rec->country_code, value, 2);
+	else if (subelement == LOCATION_CIVIC) rec->CA[type] = collectstring(rec, value, nlen);
+	else if (subelement == MAP_IMAGE_CIVIC) {
+		rec->mapmemetype = type;
+		rec->mapimagestring = collectstring(rec, value, nlen);
+	}
+	else if (subelement == LOCATION_REFERENCE_CIVIC) rec->locationreference = collectstring(rec, value, nlen);
+	else if (subelement == LOCATION_SHAPE_CIVIC) {	// (push decoder has already checked it)
+		location_shape *shape = &rec->shapespace[rec->nshapes++];
+		decodeLocationShape((const BYTE *) value, nlen, shape, rec->vertexspace + rec->vertexused, NULL);
+		rec->vertexused += 2 * shape->npoints;
+	}
+}
+
+void collectPushEnd (void *context, int nerr) {
+	push_collector *pc = (push_collector *) context;
+	pc->nerr += nerr;
+	pc->ended++;
+}
+
+int INLINE addtext (char *text, int nlen, const char *str) {
+	int n = (int) strlen(str);
+	memcpy(text + nlen, str, n);
+	return nlen + n;
+}
+
+// Hex text for raw octets as it might appear in a file: comment lines, whitespace, civic= prefix,
+// upper and lower case, and whitespace between (or inside) octets. Returns length.
+
+int hexTestText (char *text, const char *raw, int slen, uint64_t *state) {
+	static const char *prefixes[] = { "", "civic=", "-civic=", "CIVIC=" };
+	static const char *comments[] = { "# abc\n", "#\n", "# civic=01000b\r\n", "  # 0\n" };
+	int nlen = 0;
+	if (randint(state, 2)) nlen = addtext(text, nlen, comments[randint(state, 4)]);
+	if (randint(state, 4) == 0) nlen = addtext(text, nlen, " \t");
+	nlen = addtext(text, nlen, prefixes[randint(state, 4)]);
+	for (int k = 0; k < slen; k++) {
+		char hex[2];
+		putoctet(hex, 0, (BYTE) raw[k]);
+		for (int i = 0; i < 2; i++) {
+			if (randint(state, 32) == 0) text[nlen++] = (randint(state, 2)) ? ' ' : '\t';
+			text[nlen++] = (randint(state, 4) == 0 && hex[i] >= 'a') ? (char) (hex[i] - 'a' + 'A') : hex[i];
+		}
+	}
+	nlen = addtext(text, nlen, (randint(state, 2)) ? "\r\n" : "\n");
+	if (randint(state, 2)) nlen = addtext(text, nlen, comments[randint(state, 4)]);
+	text[nlen] = '\0';
+	return nlen;
+}
+
+// Push raw octets (or hex text for them) through push decoder in random sized pieces. Returns number of errors.
+
+int pushTestRecord (push_collector *pc, const char *raw, int slen, int hexflag, int budget, uint64_t *state, textbuf *tb) {
+	civic_push_decoder pd;
+	clearCivicRecord(&pc->rec);
+	reserveCivicRecord(&pc->rec, slen);
+	pc->nerr = 0;
+	pc->ended = 0;
+	initCivicPushDecoder(&pd, !hexflag, budget, collectPushField, collectPushEnd, pc, tb);
+	const char *data = raw;
+	int nlen = slen;
+	if (hexflag) {
+		nlen = hexTestText(pc->text, raw, slen, state);
+		data = pc->text;
+	}
+	for (int nbyt = 0; nbyt < nlen; ) {
+		int n = 1 + randint(state, nlen - nbyt);
+		civicPushBytes(&pd, data + nbyt, n);
+		nbyt += n;
+	}
+	if (!hexflag) civicPushEnd(&pd);	// (hex text ends CIVIC string with newline)
+	if (pc->ended != 1) {
+		outprintf(tb, "push decoder ended %d CIVIC strings, not 1\n", pc->ended);
+		pc->nerr++;
+	}
+	return pc->nerr;
+}
+
+void testfailure (test_job *job, long long n, const char *what, const char *raw, int slen, const textbuf *tb) {
+	long long nfail = job->nfail++;
+	if (nfail >= MAX_TEST_FAILURES) return;
+	std::lock_guard<std::mutex> guard(job->lock);
+	printf("FAIL case %lld: %s\n-civic=", n, what);
+	for (int k = 0; k < slen; k++) printf("%02x", (BYTE) raw[k]);
+	printf("\n%.*s", tb->nlen, tb->text);
+	fflush(stdout);
+}
+
+// Test case number n. Buffers (in tr) are big enough for any generated record.
+
+void runTestCase (test_job *job, long long n, test_record *tr, civic_record *dec, push_collector *pc, textbuf *tb) {
+	char *raw = tr->raw, *hex = tr->hex, *mut = tr->mut, *muthex = tr->muthex;
+	uint64_t state = (uint64_t) n * 0x2545f4914f6cdd1dull;
+	generateTestRecord(tr, n, &state);
+	civic_record *rec = &tr->rec;
+	tb->nlen = 0;
+
+	// (i) sizing, and hex read back against raw
+	int slen = sizeCivicRecord(rec, 1, tb);
+	int hlen = sizeCivicRecord(rec, 0, tb);
+	if (slen < 0 || hlen != 2 * slen || slen > TEST_BYTES ||
+		encodeCivicRecord(rec, 1, raw, slen, tb) != slen || encodeCivicRecord(rec, 0, hex, hlen, tb) != hlen) {
+		testfailure(job, n, "sizing / encoding", raw, 0, tb);
+		return;
+	}
+	for (int k = 0; k < slen; k++) {
+		if (getoctet(hex, k) != (BYTE) raw[k]) {
+			testfailure(job, n, "hex output read back differs from raw output", raw, slen, tb);
+			return;
+		}
+	}
+
+	// (ii) decode(encode(x)) == x
+	if (decodeCivicRecord(hex, slen, 0, dec, tb) > 0 || compareCivicRecords(rec, dec, tb) > 0) {
+		testfailure(job, n, "decode(encode(x)) != x", raw, slen, tb);
+		return;
+	}
+	for (int hexflag = 0; hexflag < 2; hexflag++) {
+		tb->nlen = 0;
+		if (pushTestRecord(pc, raw, slen, hexflag, 0, &state, tb) > 0 || compareCivicRecords(rec, &pc->rec, tb) > 0) {
+			if (hexflag) outprintf(tb, "hex text: %s", pc->text);
+			testfailure(job, n, hexflag ? "push decode(hex text of encode(x)) != x" : "push decode(encode(x)) != x", raw, slen, tb);
+			return;
+		}
+	}
+
+	// (iii) malformed: truncate, or change some octets (often lengths), then both decoders must agree
+	int mlen = slen;
+	memcpy(mut, raw, slen);
+	if (slen > 1 && randint(&state, 2)) mlen = 1 + randint(&state, slen - 1);
+	else {
+		int nchange = 1 + randint(&state, 3);
+		for (int i = 0; i < nchange; i++) mut[randint(&state, slen)] = (char) randint(&state, 256);
+	}
+	for (int k = 0; k < mlen; k++) putoctet(muthex, k, (BYTE) mut[k]);
+	int budget = 0;		// sometimes less than length (and often TEST_BUDGET for long records)
+	if (randint(&state, 4) == 0) budget = (mlen > TEST_BUDGET && randint(&state, 2)) ? TEST_BUDGET : 1 + randint(&state, mlen);
+	tb->nlen = 0;
+	int nerr1 = decodeCivicRecord(muthex, mlen, budget, dec, tb);
+	int hexflag = randint(&state, 2);
+	int nerr2 = pushTestRecord(pc, mut, mlen, hexflag, budget, &state, tb);
+	if ((nerr1 > 0) != (nerr2 > 0)) {
+		outprintf(tb, "batch decoder %d errors, push decoder (%s) %d errors, budget %d\n",
+				  nerr1, hexflag ? "hex" : "raw", nerr2, budget);
+		testfailure(job, n, "decoders disagree on malformed string", mut, mlen, tb);
+	}
+	else if (nerr1 == 0 && compareCivicRecords(dec, &pc->rec, tb) > 0)
+		testfailure(job, n, "decoders disagree on fields of mutated string", mut, mlen, tb);
+
+	// (iv) bulk encoding of shapes
+	if (n % BULK_TEST_EVERY != 0) return;
+	tb->nlen = 0;
+	if (testBulkShapes(tr, &state, tb) > 0)
+		testfailure(job, n, "encodeLocationShapes()", tr->bulkraw, 0, tb);
+}
+
+void testWorker (test_job *job) {
+	test_record *tr = (test_record *) malloc(sizeof(test_record));
+	civic_record dec;
+	push_collector pc;
+	textbuf tb = { NULL, 0, 0 };
+	if (tr == NULL) exit(1);
+	initCivicRecord(&dec);
+	initCivicRecord(&pc.rec);
+	for (;;) {
+		long long first = job->nextcase.fetch_add(TEST_BATCH);
+		if (first >= job->ncases) break;
+		long long last = first + TEST_BATCH;
+		if (last > job->ncases) last = job->ncases;
+		for (long long n = first; n < last; n++) runTestCase(job, n, tr, &dec, &pc, &tb);
+	}
+	free(tb.text);
+	freeCivicRecord(&dec);
+	freeCivicRecord(&pc.rec);
+	free(tr);
+}
+
+void unicodeWorker (std::atomic<int> *next, std::atomic<int> *nerr) {
+	const int nblock = 0x10000;
+	int umin;
+	while ((umin = next->fetch_add(nblock)) < 0x200000)
+		*nerr += test_utf_unicode(umin, umin + nblock);
+}
+
+// Corrected example must decode, buggy examples (from hostapd tests) must give errors, in both decoders
+
+int testBuggyExamples (void) {
+	const char *examples[] = { civic1, civic1a, civic2 };
+	int nfail = 0;
+	civic_record rec;
+	push_collector pc;
+	textbuf tb = { NULL, 0, 0 };
+	initCivicRecord(&rec);
+	initCivicRecord(&pc.rec);
+	for (int j = 0; j < 6; j++) {		// each example, fed to push decoder as raw octets and as hex text
+		int i = j / 2, hexflag = j % 2;
+		int slen = (int) strlen(examples[i]) / 2;
+		char raw[512];
+		uint64_t state = j;
+		tb.nlen = 0;
+		for (int k = 0; k < slen; k++) raw[k] = (char) getoctet(examples[i], k);
+		int nerr1 = decodeCivicRecord(examples[i], slen, 0, &rec, &tb);
+		int nerr2 = pushTestRecord(&pc, raw, slen, hexflag, 0, &state, &tb);
+		if ((i == 0) ? (nerr1 > 0 || nerr2 > 0 || compareCivicRecords(&rec, &pc.rec, &tb) > 0) : (nerr1 == 0 || nerr2 == 0)) {
+			printf("FAIL example %d (%s) (%d, %d errors)\n%.*s", i, hexflag ? "hex" : "raw", nerr1, nerr2, tb.nlen, tb.text);
+			nfail++;
+		}
+	}
+	free(tb.text);
+	freeCivicRecord(&rec);
+	freeCivicRecord(&pc.rec);
+	return nfail;
+}
+
+// Returns number of failures
+
+long long runSelfTest (long long ncases, int nthreads) {
+	if (nthreads <= 0) nthreads = (int) std::thread::hardware_concurrency();
+	if (nthreads <= 0) nthreads = 1;
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	long long nfail = testBuggyExamples();
+
+	std::atomic<int> nextcode(0), nunicode(0);
+	std::thread *workers = new std::thread[nthreads];
+	for (int i = 0; i < nthreads; i++) workers[i] = std::thread(unicodeWorker, &nextcode, &nunicode);
+	for (int i = 0; i < nthreads; i++) workers[i].join();
+	nfail += nunicode;
+
+	test_job *job = new test_job;
+	job->ncases = ncases;
+	job->nextcase = 0;
+	job->nfail = 0;
+	for (int i = 0; i < nthreads; i++) workers[i] = std::thread(testWorker, job);
+	for (int i = 0; i < nthreads; i++) workers[i].join();
+	nfail += job->nfail;
+	delete job;
+	delete [] workers;
+
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	printf("Self test: %lld cases + %d code points on %d threads in %.2f sec: %lld failures\n",
+		   ncases, 0x200000, nthreads, secs, nfail);
+	return nfail;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+void doExample(void) {
+	const char *civicstr = "01000b001d555301024d41030943616d627269646765130233322206566173736172";
+	printf("-civic=%s\n", civicstr);
+	decodeCivicString(civicstr);
+	char *str = encodeCivicString();
+	if (str != NULL) printf("-civic=%s\n", str);
+	free(str);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+void freeCivicValues () {
+	for (int k = 0; k <= MAX_CA_TYPE; k++) {
+		if (CA[k] == NULL) continue;
+		free((void *) CA[k]);
+		CA[k] = NULL;
+	}
+	free(CA);
+	CA = NULL;
+	for (int i = 0; i < nlocationshapes; i++) free((void *) locationshapes[i].xy);
+	free(locationshapes);
+	locationshapes = NULL;
+	nlocationshapes = 0;
+}
+
+void initialize_arrays (void) {
+	CA = (char const **) malloc((MAX_CA_TYPE+1) * sizeof(char *));	// place for civic location values
+	if (CA == NULL) exit(1);
+//	for (int k = 0; k <= MAX_CA_TYPE; k++) CA[k] = NULL;	// or...
+	memset(CA, 0, (MAX_CA_TYPE+1) * sizeof(char *));
+}
+
+int main(int argc, const char *argv[]) {
+	int firstarg = 1;
+
+//	test_utf_unicode(0, 0x200000); return 0;	// (now part of -test)
+	initialize_arrays();
+	firstarg = commandline(argc, argv);
+
+	int ncivic = lengthCivicValues();	// any command line arguments for constructing civic string?
+	if (debugflag) printf("ncivic %d bytes\n", ncivic);
+	if (ncivic > 0)	showCivicValues();
+
+//	Is file of CIVIC strings given on command line ?
+	if (civicfile != NULL) {
+		if (exportfile != NULL) exportCivicCorpus(civicfile, exportfile);
+		else decodeCivicFile(civicfile, nthreads);
+	}
+//	Run self test ?
+	else if (ntests > 0) {
+		if (runSelfTest(ntests, nthreads) > 0) {
+			freeCivicValues();
+			return 1;
+		}
+	}
+//	Decode CIVIC strings from stdin ?
+	else if (streamflag) {
+		decodeCivicStream(rawflag, chunksize);
+	}
+//	Is directory of hostapd.conf files to watch given on command line ?
+	else if (watchdir != NULL) {
+		watchCivicDirectory(watchdir);
+	}
+//	Is corpus file given on command line ?
+	else if (corpusfile != NULL) {
+		showCivicCorpus(corpusfile, corpuscolumn);
+	}
+//	Is CIVIC string given on command line ?
+	else if (civicstring != NULL) {
+		decodeCivicString(civicstring);
+		if (checkflag) {
+			printf("\n");
+			ncivic = lengthCivicValues();
+			char *str = encodeCivicString();
+			if (str != NULL) printf("-civic=%s\n", str);
+			free(str);
+		}
+//		return 0;
+	}
+//	Are arguments for constructing CIVIC string given on command line ?
+	else if (ncivic > 0 || mapimagestring != NULL || locationreference != NULL || nlocationshapes > 0) {
+		char *str = encodeCivicString();
+		if (str != NULL) printf("-civic=%s\n", str);
+		if (checkflag && str != NULL) {
 			printf("\n");
 			decodeCivicString(str);
 		}